@@ -0,0 +1,444 @@
+/*
+ * Maildir Plugin -- Maildir++ support for Sylpheed
+ * Copyright (C) 2003-2004 Christoph Hohmann
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+
+
+#include "pluginconfig.h"
+
+#include <glib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "codeconv.h"
+#include "procheader.h"
+#include "procmsg.h"
+#include "headerscan.h"
+
+/*
+ * A header parser for the fields of the message summary. The file is
+ * mapped, the lines are found with memchr and the fields are looked up
+ * through a table indexed by their first character, everything else is
+ * skipped without being copied. The values go through the same
+ * functions procheader uses, so the MsgInfo matches the one of
+ * procheader_parse_file.
+ *
+ * Messages with fields this parser doesn't know how to handle, 8 bit
+ * headers or an mbox "From " line are left to procheader_parse_file,
+ * the functions below return NULL for them.
+ *
+ * Reading is split from parsing: headerscan_read_file only does I/O and
+ * may run in any thread, while headerscan_parse_block calls into
+ * codeconv and procheader and has to run in the main thread.
+ */
+
+struct _HeaderBlock
+{
+	gchar		*data;		/* the header, up to the empty line */
+	gsize		 len;
+	goffset		 size;		/* of the whole file */
+	time_t		 mtime;
+};
+
+typedef enum
+{
+	SCAN_FALLBACK,
+	SCAN_DATE,
+	SCAN_FROM,
+	SCAN_TO,
+	SCAN_CC,
+	SCAN_SUBJECT,
+	SCAN_MSG_ID,
+	SCAN_REFERENCES,
+	SCAN_IN_REPLY_TO,
+	SCAN_CONTENT_TYPE,
+	SCAN_XREF,
+	SCAN_LIST
+} ScanFieldId;
+
+typedef struct _ScanField
+{
+	const gchar	*name;
+	gsize		 len;
+	gboolean	 prefix;	/* matches every field starting with name */
+	ScanFieldId	 id;
+	glong		 offset;	/* of the string in MsgInfoExtraData */
+} ScanField;
+
+#define FIELD(name, id)		{ name, sizeof(name) - 1, FALSE, id, 0 }
+#define FIELD_PREFIX(name, id)	{ name, sizeof(name) - 1, TRUE, id, 0 }
+#define LIST_FIELD(name, member) \
+	{ name, sizeof(name) - 1, FALSE, SCAN_LIST, \
+	  G_STRUCT_OFFSET(MsgInfoExtraData, member) }
+#define FIELD_END		{ NULL, 0, FALSE, 0, 0 }
+
+/* Every field procheader_parse_file reads into a MsgInfo has to be
+ * listed here, either handled by set_field or as SCAN_FALLBACK. */
+static const ScanField c_fields[] = {
+	FIELD("Cc", SCAN_CC),
+	FIELD("Content-Type", SCAN_CONTENT_TYPE),
+	FIELD_END
+};
+
+static const ScanField d_fields[] = {
+	FIELD("Date", SCAN_DATE),
+	FIELD("Disposition-Notification-To", SCAN_FALLBACK),
+	FIELD_END
+};
+
+static const ScanField f_fields[] = {
+	FIELD("From", SCAN_FROM),
+	FIELD("Face", SCAN_FALLBACK),
+	FIELD("Followup-To", SCAN_FALLBACK),
+	FIELD_END
+};
+
+static const ScanField i_fields[] = {
+	FIELD("In-Reply-To", SCAN_IN_REPLY_TO),
+	FIELD_END
+};
+
+static const ScanField l_fields[] = {
+	LIST_FIELD("List-Post", list_post),
+	LIST_FIELD("List-Subscribe", list_subscribe),
+	LIST_FIELD("List-Unsubscribe", list_unsubscribe),
+	LIST_FIELD("List-Help", list_help),
+	LIST_FIELD("List-Archive", list_archive),
+	LIST_FIELD("List-Owner", list_owner),
+	FIELD_END
+};
+
+static const ScanField m_fields[] = {
+	FIELD("Message-ID", SCAN_MSG_ID),
+	FIELD_END
+};
+
+static const ScanField n_fields[] = {
+	FIELD("Newsgroups", SCAN_FALLBACK),
+	FIELD_END
+};
+
+static const ScanField p_fields[] = {
+	FIELD("Priority", SCAN_FALLBACK),
+	FIELD_END
+};
+
+static const ScanField r_fields[] = {
+	FIELD("References", SCAN_REFERENCES),
+	FIELD("Return-Receipt-To", SCAN_FALLBACK),
+	FIELD("Resent-From", SCAN_FALLBACK),
+	FIELD_END
+};
+
+static const ScanField s_fields[] = {
+	FIELD("Subject", SCAN_SUBJECT),
+	FIELD("Seen", SCAN_FALLBACK),
+	FIELD("Status", SCAN_FALLBACK),
+	FIELD_PREFIX("SC-", SCAN_FALLBACK),
+	FIELD_END
+};
+
+static const ScanField t_fields[] = {
+	FIELD("To", SCAN_TO),
+	FIELD_END
+};
+
+static const ScanField x_fields[] = {
+	FIELD("X-Face", SCAN_FALLBACK),
+	FIELD("X-Priority", SCAN_FALLBACK),
+	FIELD("X-Status", SCAN_FALLBACK),
+	FIELD("X-Label", SCAN_FALLBACK),
+	FIELD("Xref", SCAN_XREF),
+	FIELD_END
+};
+
+static const ScanField *scan_table[128] = {
+	['C'] = c_fields, ['c'] = c_fields,
+	['D'] = d_fields, ['d'] = d_fields,
+	['F'] = f_fields, ['f'] = f_fields,
+	['I'] = i_fields, ['i'] = i_fields,
+	['L'] = l_fields, ['l'] = l_fields,
+	['M'] = m_fields, ['m'] = m_fields,
+	['N'] = n_fields, ['n'] = n_fields,
+	['P'] = p_fields, ['p'] = p_fields,
+	['R'] = r_fields, ['r'] = r_fields,
+	['S'] = s_fields, ['s'] = s_fields,
+	['T'] = t_fields, ['t'] = t_fields,
+	['X'] = x_fields, ['x'] = x_fields,
+};
+
+static const ScanField *lookup_field(const gchar *name, gsize len)
+{
+	const ScanField *field;
+	guchar c = name[0];
+
+	if (len == 0 || c >= G_N_ELEMENTS(scan_table) ||
+	    (field = scan_table[c]) == NULL)
+		return NULL;
+
+	for (; field->name != NULL; field++) {
+		if ((field->prefix ? len >= field->len : len == field->len) &&
+		    !g_ascii_strncasecmp(name, field->name, field->len))
+			return field;
+	}
+
+	return NULL;
+}
+
+/* Tests eight bytes at a time for bytes with the high bit set */
+static gboolean has_8bit(const gchar *data, gsize len)
+{
+	const guchar *p = (const guchar *) data, *end = p + len;
+	guint64 word;
+
+	for (; p + sizeof(word) <= end; p += sizeof(word)) {
+		memcpy(&word, p, sizeof(word));
+		if (word & G_GUINT64_CONSTANT(0x8080808080808080))
+			return TRUE;
+	}
+	for (; p < end; p++)
+		if (*p & 0x80)
+			return TRUE;
+
+	return FALSE;
+}
+
+/* Returns the start of the empty line after the header */
+static const gchar *find_header_end(const gchar *data, const gchar *end)
+{
+	const gchar *p, *nl;
+
+	for (p = data; p < end; p = nl + 1) {
+		if (*p == '\n' || (*p == '\r' && p + 1 < end && p[1] == '\n'))
+			return p;
+		if ((nl = memchr(p, '\n', end - p)) == NULL)
+			break;
+	}
+
+	return end;
+}
+
+/* Returns the value from p to end, unfolded and without leading space */
+static gchar *get_value(const gchar *p, const gchar *end)
+{
+	gchar *value, *q;
+
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+
+	q = value = g_malloc(end - p + 1);
+	for (; p < end; p++)
+		if (*p != '\r' && *p != '\n')
+			*q++ = *p;
+	*q = '\0';
+
+	return value;
+}
+
+static void append_addresses(gchar **field, const gchar *value)
+{
+	gchar *tmp, *old;
+
+	tmp = conv_unmime_header(value, NULL, TRUE);
+	remove_return(tmp);
+	if (*field != NULL) {
+		old = *field;
+		*field = g_strconcat(old, ", ", tmp, NULL);
+		g_free(old);
+		g_free(tmp);
+	} else
+		*field = tmp;
+}
+
+static void set_field(MsgInfo *msginfo, const ScanField *field, gchar *value)
+{
+	gchar **extra, *p;
+
+	switch (field->id) {
+	case SCAN_DATE:
+		if (msginfo->date != NULL)
+			break;
+		msginfo->date_t = procheader_date_parse(NULL, value, 0);
+		msginfo->date = g_strdup(value);
+		break;
+	case SCAN_FROM:
+		if (msginfo->from != NULL)
+			break;
+		msginfo->from = conv_unmime_header(value, NULL, TRUE);
+		msginfo->fromname = procheader_get_fromname(msginfo->from);
+		remove_return(msginfo->from);
+		remove_return(msginfo->fromname);
+		break;
+	case SCAN_TO:
+		append_addresses(&msginfo->to, value);
+		break;
+	case SCAN_CC:
+		append_addresses(&msginfo->cc, value);
+		break;
+	case SCAN_SUBJECT:
+		if (msginfo->subject != NULL)
+			break;
+		msginfo->subject = conv_unmime_header(value, NULL, FALSE);
+		unfold_line(msginfo->subject);
+		break;
+	case SCAN_MSG_ID:
+		if (msginfo->msgid != NULL)
+			break;
+		extract_parenthesis(value, '<', '>');
+		remove_space(value);
+		msginfo->msgid = g_strdup(value);
+		break;
+	case SCAN_REFERENCES:
+		msginfo->references =
+			references_list_prepend(msginfo->references, value);
+		break;
+	case SCAN_IN_REPLY_TO:
+		if (msginfo->inreplyto != NULL)
+			break;
+		eliminate_parenthesis(value, '(', ')');
+		if ((p = strrchr(value, '<')) != NULL && strchr(p + 1, '>') != NULL) {
+			extract_parenthesis(p, '<', '>');
+			remove_space(p);
+			if (*p != '\0')
+				msginfo->inreplyto = g_strdup(p);
+		}
+		break;
+	case SCAN_CONTENT_TYPE:
+		if (!g_ascii_strncasecmp(value, "multipart/", 10))
+			MSG_SET_TMP_FLAGS(msginfo->flags, MSG_MULTIPART);
+		break;
+	case SCAN_XREF:
+		if (msginfo->xref != NULL)
+			break;
+		msginfo->xref = g_strdup(value);
+		break;
+	case SCAN_LIST:
+		if (msginfo->extradata == NULL)
+			msginfo->extradata = g_new0(MsgInfoExtraData, 1);
+		extra = G_STRUCT_MEMBER_P(msginfo->extradata, field->offset);
+		if (*extra == NULL)
+			*extra = conv_unmime_header(value, NULL, FALSE);
+		break;
+	default:
+		break;
+	}
+}
+
+static gboolean scan_header(MsgInfo *msginfo, const gchar *data, const gchar *end)
+{
+	const gchar *p, *nl, *next, *colon;
+	const ScanField *field;
+	gchar *value;
+
+	for (p = data; p < end; p = next) {
+		/* the field with its continuation lines */
+		next = p;
+		do {
+			nl = memchr(next, '\n', end - next);
+			next = nl != NULL ? nl + 1 : end;
+		} while (next < end && (*next == ' ' || *next == '\t'));
+
+		if ((colon = memchr(p, ':', next - p)) == NULL)
+			return FALSE;
+		if ((field = lookup_field(p, colon - p)) == NULL)
+			continue;
+		if (field->id == SCAN_FALLBACK)
+			return FALSE;
+
+		value = get_value(colon + 1, next);
+		set_field(msginfo, field, value);
+		g_free(value);
+	}
+
+	if (msginfo->inreplyto == NULL && msginfo->references != NULL)
+		msginfo->inreplyto = g_strdup((gchar *) msginfo->references->data);
+
+	return TRUE;
+}
+
+/* Reads the header of the message in file, or returns NULL if the
+ * message has to be parsed by procheader_parse_file */
+HeaderBlock *headerscan_read_file(const gchar *file)
+{
+	HeaderBlock *block = NULL;
+	struct stat s;
+	const gchar *end;
+	gchar *data;
+	gint fd;
+
+	if ((fd = open(file, O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(fd, &s) < 0 || !S_ISREG(s.st_mode) || s.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+	data = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	/* copy the header, a mapping per message would run into the limit
+	 * of mappings when many are read ahead */
+	end = find_header_end(data, data + s.st_size);
+	if (!(end - data >= 5 && !strncmp(data, "From ", 5)) &&
+	    !has_8bit(data, end - data)) {
+		block = g_new(HeaderBlock, 1);
+		block->len = end - data;
+		block->data = g_malloc(block->len);
+		memcpy(block->data, data, block->len);
+		block->size = (goffset) s.st_size;
+		block->mtime = s.st_mtime;
+	}
+
+	munmap(data, s.st_size);
+
+	return block;
+}
+
+/* Returns the MsgInfo of the header in block, or NULL if the message has
+ * to be parsed by procheader_parse_file */
+MsgInfo *headerscan_parse_block(const HeaderBlock *block, MsgFlags flags)
+{
+	MsgInfo *msginfo;
+
+	g_return_val_if_fail(block != NULL, NULL);
+
+	msginfo = procmsg_msginfo_new();
+	msginfo->flags = flags;
+	msginfo->size = block->size;
+	msginfo->mtime = block->mtime;
+
+	if (!scan_header(msginfo, block->data, block->data + block->len))
+		procmsg_msginfo_free(&msginfo);
+
+	return msginfo;
+}
+
+void headerscan_free_block(HeaderBlock *block)
+{
+	if (block == NULL)
+		return;
+
+	g_free(block->data);
+	g_free(block);
+}
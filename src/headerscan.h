@@ -0,0 +1,34 @@
+/*
+ * Maildir Plugin -- Maildir++ support for Sylpheed
+ * Copyright (C) 2003 Christoph Hohmann
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+
+#ifndef HEADERSCAN_H
+#define HEADERSCAN_H 1
+
+#include <glib.h>
+
+#include "procmsg.h"
+
+typedef struct _HeaderBlock HeaderBlock;
+
+HeaderBlock *headerscan_read_file(const gchar *);
+MsgInfo *headerscan_parse_block(const HeaderBlock *, MsgFlags);
+void headerscan_free_block(HeaderBlock *);
+
+#endif /* HEADERSCAN_H */
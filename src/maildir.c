@@ -17,19 +17,37 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE	/* copy_file_range, syncfs */
+#endif
+
 #ifdef HAVE_CONFIG_H
 #  include "config.h"
 #endif
 
 #include "defs.h"
+#include "pluginconfig.h"
 
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
 #include <glob.h>
 #include <unistd.h>
 #include <glib.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#  include <sys/inotify.h>
+#endif
+#ifdef __linux__
+#  include <sys/syscall.h>
+#endif
+#ifdef HAVE_LINUX_FS_H
+#  include <sys/ioctl.h>
+#  include <linux/fs.h>
+#endif
 
 #include "utils.h"
 #include "procmsg.h"
@@ -38,19 +56,57 @@
 #include "maildir.h"
 #include "localfolder.h"
 #include "uiddb.h"
+#include "uidlist.h"
+#include "summarycache.h"
+#include "headerscan.h"
 #include "mainwindow.h"
 #include "summaryview.h"
 #include "messageview.h"
 #include "file-utils.h"
+#include "xml.h"
+#include "filtering.h"
 
 #define MAILDIR_FOLDERITEM(item) ((MaildirFolderItem *) item)
+#define MAILDIR_FOLDER(folder) ((MaildirFolder *) folder)
+
+#define MAX_OPEN_DATABASES	32	/* UIDDB handles kept open at most */
+#define DATABASE_IDLE_TIMEOUT	60	/* seconds until an unused handle is closed */
+#define PARSE_THREADS_MAX	8	/* upper bound of header reader threads */
+#define PARSE_THREADS_MIN_JOBS	32	/* smaller batches are read inline */
+#define PARSE_READ_AHEAD	256	/* headers read but not parsed yet */
+#define WATCH_DEBOUNCE		500	/* ms to wait for more inotify events */
+#define COPY_BUFFER_SIZE	(256 * 1024)	/* read/write size of plain copies */
+#define SYNCFS_MIN_BATCH	8	/* smaller batches sync file by file */
 
 typedef struct _MaildirFolder MaildirFolder;
 typedef struct _MaildirFolderItem MaildirFolderItem;
 
+typedef enum
+{
+	UIDSOURCE_OWN,		/* UIDs are assigned by the plugin */
+	UIDSOURCE_DOVECOT,	/* UIDs follow dovecot-uidlist */
+	UIDSOURCE_DOVECOT_WRITE,	/* and new messages are added to it */
+	UIDSOURCE_COURIER	/* UIDs follow courierimapuiddb */
+} MaildirUidSource;
+
+static const gchar *uidsource_names[] = {
+	"own", "dovecot", "dovecot-write", "courier"
+};
+
+typedef enum
+{
+	SYNC_NONE,		/* leave it to the kernel */
+	SYNC_MESSAGE,		/* fdatasync every message, fsync its directory */
+	SYNC_BATCH		/* one sync for all messages added at once */
+} MaildirSyncPolicy;
+
+static const gchar *sync_policy_names[] = { "none", "message", "batch" };
+
 static Folder *maildir_folder_new(const gchar * name,
 				  const gchar * folder);
 static void maildir_folder_destroy(Folder * folder);
+static void maildir_folder_set_xml(Folder * folder, XMLTag * tag);
+static XMLTag *maildir_folder_get_xml(Folder * folder);
 static gint maildir_scan_tree(Folder * folder);
 static FolderItem *maildir_item_new(Folder * folder);
 static void maildir_item_destroy(Folder * folder, FolderItem * item);
@@ -59,16 +115,26 @@ static gint maildir_get_num_list(Folder * folder, FolderItem * item,
 				 MsgNumberList ** list,
 				 gboolean * old_uids_valid);
 static gboolean maildir_scan_required(Folder * folder, FolderItem * item);
+static void maildir_item_closed(Folder * folder, FolderItem * item);
 static MsgInfo *maildir_get_msginfo(Folder * folder, FolderItem * item,
 				    gint num);
+static MsgInfoList *maildir_get_msginfos(Folder * folder, FolderItem * item,
+					 MsgNumberList * msgnum_list);
 static gchar *maildir_fetch_msg(Folder * folder, FolderItem * item,
 				gint num);
 static gint maildir_add_msg(Folder * folder, FolderItem * _dest,
 			    const gchar * file, MsgFlags * flags);
+static gint maildir_add_msgs(Folder * folder, FolderItem * _dest,
+			     GSList * file_list, GHashTable * relation);
 static gint maildir_copy_msg(Folder * folder, FolderItem * dest,
 			     MsgInfo * msginfo);
+static gint maildir_copy_msgs(Folder * folder, FolderItem * dest,
+			      MsgInfoList * msglist, GHashTable * relation);
 static gint maildir_remove_msg(Folder * folder, FolderItem * _item,
 			       gint num);
+static gint maildir_remove_msgs(Folder * folder, FolderItem * _item,
+				MsgInfoList * msglist, GHashTable * relation);
+static gint maildir_remove_all_msg(Folder * folder, FolderItem * _item);
 static void maildir_change_flags(Folder * folder, FolderItem * item,
 				 MsgInfo * msginfo, MsgPermFlags newflags);
 static FolderItem *maildir_create_folder(Folder * folder,
@@ -81,6 +147,7 @@ static gint maildir_rename_folder(Folder *folder, FolderItem *item,
 			     const gchar *name);
 static gint maildir_get_flags (Folder *folder,  FolderItem *item,
 			       MsgInfoList *msglist, GHashTable *msgflags);
+static void maildir_set_batch(Folder *folder, FolderItem *item, gboolean batch);
 
 static gchar *filename_from_utf8(const gchar *path);
 static gchar *filename_to_utf8(const gchar *path);
@@ -90,6 +157,14 @@ FolderClass maildir_class;
 struct _MaildirFolder
 {
 	LocalFolder folder;
+
+	UIDDBBackendType uiddb_backend;	/* storage of the UID databases */
+	MaildirUidSource uidsource;
+	MaildirSyncPolicy sync_policy;	/* durability of added messages */
+
+	gboolean lazy;		/* load subfolders when they are shown */
+	GPtrArray *folder_names;	/* sorted directory names of all folders,
+					   NULL until read in lazy mode */
 };
 
 struct _MaildirFolderItem
@@ -98,8 +173,50 @@ struct _MaildirFolderItem
 
 	guint lastuid;
 	UIDDB *db;
+
+	guint db_users;		/* nesting depth of open_database() */
+	GList *db_link;		/* node in open_databases while db is open */
+	time_t db_last_used;
+	time_t db_mtime;	/* last modification through a cached handle */
+	SummaryCache *summary;	/* header cache, open while db is */
+
+	gint wd_cur, wd_new;	/* inotify watches on cur/ and new/ or -1 */
+	gboolean synced;	/* UIDDB follows cur/ and new/ since last scan */
+	GHashTable *added;	/* "dir/name" of files that appeared */
+	GHashTable *removed;	/* uniqs of files that disappeared */
+
+	UidList *uidlist;	/* the IMAP server's UIDs or NULL */
+	GSList *unlisted;	/* names of files Dovecot has no UID for */
+	gboolean renumbered;	/* a UID was taken from another message */
+
+	gboolean batch;		/* flag changes are collected */
+	GHashTable *flag_changes;	/* UID -> FlagChange, applied after the batch */
+
+	guint scan_generation;	/* bumped by scans and lost watches */
+	guint flags_generation;	/* scan the flags below were taken from */
+	GHashTable *scan_flags;	/* UID -> MsgPermFlags from the file names */
 };
 
+/* scan_flags value of a file name without flags */
+#define SCAN_FLAGS_NONE		G_MAXUINT
+
+/* MaildirFolderItems with an open UIDDB handle, most recently used first */
+static GQueue open_databases = { NULL, NULL, 0 };
+static guint database_timer = 0;
+
+#ifdef HAVE_SYS_INOTIFY_H
+static gint inotify_fd = -1;
+static guint inotify_source = 0;
+static GHashTable *watches = NULL;	/* watch descriptor -> MaildirFolderItem */
+static GSList *watch_pending = NULL;	/* items with queued changes */
+static guint watch_timer = 0;
+#endif
+
+static void unwatch_item(MaildirFolderItem *item);
+static void free_unlisted(MaildirFolderItem *item);
+static void flush_flag_changes(MaildirFolderItem *item);
+static void set_scan_flags(MaildirFolderItem *item, guint32 uid, const gchar *info);
+
 FolderClass *maildir_get_class()
 {
 	if (maildir_class.idstr == NULL) {
@@ -110,8 +227,8 @@ FolderClass *maildir_get_class()
 		/* Folder functions */
 		maildir_class.new_folder = maildir_folder_new;
 		maildir_class.destroy_folder = maildir_folder_destroy;
-		maildir_class.set_xml = folder_local_set_xml;
-		maildir_class.get_xml = folder_local_get_xml;
+		maildir_class.set_xml = maildir_folder_set_xml;
+		maildir_class.get_xml = maildir_folder_get_xml;
 		maildir_class.scan_tree = maildir_scan_tree;
 		maildir_class.create_tree = maildir_create_tree;
 
@@ -124,15 +241,22 @@ FolderClass *maildir_get_class()
 		maildir_class.rename_folder = maildir_rename_folder;
 		maildir_class.get_num_list = maildir_get_num_list;
 		maildir_class.scan_required = maildir_scan_required;
+		maildir_class.item_closed = maildir_item_closed;
 
 		/* Message functions */
 		maildir_class.get_msginfo = maildir_get_msginfo;
+		maildir_class.get_msginfos = maildir_get_msginfos;
 		maildir_class.fetch_msg = maildir_fetch_msg;
 		maildir_class.add_msg = maildir_add_msg;
+		maildir_class.add_msgs = maildir_add_msgs;
 		maildir_class.copy_msg = maildir_copy_msg;
+		maildir_class.copy_msgs = maildir_copy_msgs;
 		maildir_class.remove_msg = maildir_remove_msg;
+		maildir_class.remove_msgs = maildir_remove_msgs;
+		maildir_class.remove_all_msg = maildir_remove_all_msg;
 		maildir_class.change_flags = maildir_change_flags;
 		maildir_class.get_flags = maildir_get_flags;
+		maildir_class.set_batch = maildir_set_batch;
 	}
 
 	return &maildir_class;
@@ -146,6 +270,8 @@ static Folder *maildir_folder_new(const gchar * name,
         folder = g_new0(MaildirFolder, 1);
         FOLDER(folder)->klass = &maildir_class;
         folder_local_folder_init(FOLDER(folder), name, path);
+        folder->uiddb_backend = uiddb_backend_get_default();
+        folder->sync_policy = SYNC_NONE;
 
         return FOLDER(folder);
 }
@@ -154,31 +280,255 @@ static void maildir_folder_destroy(Folder *_folder)
 {
 	MaildirFolder *folder = (MaildirFolder *) _folder;
 
+	if (folder->folder_names != NULL)
+		g_ptr_array_free(folder->folder_names, TRUE);
 	folder_local_folder_destroy(LOCAL_FOLDER(folder));
 }
 
+static void maildir_folder_set_xml(Folder *folder, XMLTag *tag)
+{
+	GList *cur;
+
+	folder_local_set_xml(folder, tag);
+
+	for (cur = tag->attr; cur != NULL; cur = g_list_next(cur)) {
+		XMLAttr *attr = (XMLAttr *) cur->data;
+		UIDDBBackendType backend;
+		MaildirUidSource source;
+		MaildirSyncPolicy policy;
+
+		if (!attr || !attr->name || !attr->value)
+			continue;
+
+		if (!strcmp(attr->name, "uiddb")) {
+			backend = uiddb_backend_from_name(attr->value);
+			if (uiddb_backend_available(backend))
+				MAILDIR_FOLDER(folder)->uiddb_backend = backend;
+			else
+				g_warning("Maildir: UID database backend %s is not "
+					  "available, using %s\n", attr->value,
+					  uiddb_backend_get_name(MAILDIR_FOLDER(folder)->uiddb_backend));
+		} else if (!strcmp(attr->name, "uidsource")) {
+			for (source = 0; source < G_N_ELEMENTS(uidsource_names); source++)
+				if (!strcmp(attr->value, uidsource_names[source]))
+					MAILDIR_FOLDER(folder)->uidsource = source;
+		} else if (!strcmp(attr->name, "sync")) {
+			for (policy = 0; policy < G_N_ELEMENTS(sync_policy_names); policy++)
+				if (!strcmp(attr->value, sync_policy_names[policy]))
+					MAILDIR_FOLDER(folder)->sync_policy = policy;
+		} else if (!strcmp(attr->name, "lazy")) {
+			MAILDIR_FOLDER(folder)->lazy = atoi(attr->value) != 0;
+		}
+	}
+}
+
+static XMLTag *maildir_folder_get_xml(Folder *folder)
+{
+	XMLTag *tag;
+
+	tag = folder_local_get_xml(folder);
+	xml_tag_add_attr(tag, xml_attr_new("uiddb",
+		uiddb_backend_get_name(MAILDIR_FOLDER(folder)->uiddb_backend)));
+	xml_tag_add_attr(tag, xml_attr_new("uidsource",
+		uidsource_names[MAILDIR_FOLDER(folder)->uidsource]));
+	xml_tag_add_attr(tag, xml_attr_new("sync",
+		sync_policy_names[MAILDIR_FOLDER(folder)->sync_policy]));
+	xml_tag_add_attr(tag, xml_attr_new("lazy",
+		MAILDIR_FOLDER(folder)->lazy ? "1" : "0"));
+
+	return tag;
+}
+
+static gboolean keep_summary_func(const gchar *uniq, gpointer data)
+{
+	MessageDataView view;
+
+	return uiddb_view_entry_for_uniq(MAILDIR_FOLDERITEM(data)->db, uniq, &view);
+}
+
+/* Writes the summary cache, without the entries of messages that are gone */
+static void save_summary_cache(MaildirFolderItem *item)
+{
+	if (item->summary != NULL && item->db != NULL)
+		summary_cache_save(item->summary, keep_summary_func, item);
+}
+
+static SummaryCache *get_summary_cache(MaildirFolderItem *item)
+{
+	gchar *path, *file;
+
+	if (item->summary == NULL) {
+		path = maildir_item_get_path(FOLDER_ITEM(item)->folder, FOLDER_ITEM(item));
+		file = g_strconcat(path, G_DIR_SEPARATOR_S, SUMMARY_CACHE_FILE, NULL);
+		item->summary = summary_cache_open(file);
+		g_free(file);
+		g_free(path);
+	}
+
+	return item->summary;
+}
+
+static void release_database(MaildirFolderItem *item)
+{
+	g_return_if_fail(item->db != NULL);
+	g_return_if_fail(item->db_users == 0);
+
+	debug_print("closing database of %s\n", FOLDER_ITEM(item)->path ? FOLDER_ITEM(item)->path : "inbox");
+
+	g_queue_delete_link(&open_databases, item->db_link);
+	item->db_link = NULL;
+
+	if (item->summary != NULL) {
+		save_summary_cache(item);
+		summary_cache_close(item->summary);
+		item->summary = NULL;
+	}
+
+	if (uiddb_take_changed(item->db))
+		item->db_mtime = time(NULL);
+	uiddb_close(item->db);
+	item->db = NULL;
+}
+
+static gboolean database_timeout_cb(gpointer data)
+{
+	GList *cur, *prev;
+	time_t now = time(NULL);
+
+	for (cur = open_databases.tail; cur != NULL; cur = prev) {
+		MaildirFolderItem *item = cur->data;
+
+		prev = cur->prev;
+		if (item->db_users == 0 &&
+		    now - item->db_last_used >= DATABASE_IDLE_TIMEOUT)
+			release_database(item);
+	}
+
+	if (open_databases.length > 0)
+		return TRUE;
+
+	database_timer = 0;
+	return FALSE;
+}
+
+static void evict_databases(void)
+{
+	GList *cur, *prev;
+
+	for (cur = open_databases.tail;
+	     cur != NULL && open_databases.length >= MAX_OPEN_DATABASES;
+	     cur = prev) {
+		MaildirFolderItem *item = cur->data;
+
+		prev = cur->prev;
+		if (item->db_users == 0)
+			release_database(item);
+	}
+}
+
+/* Takes over the UID database of another backend if the folder has
+ * one, so that switching backends keeps the UIDs */
+static void convert_database(const gchar *path, UIDDBBackendType backend,
+			     const gchar *database)
+{
+	UIDDBBackendType other;
+	gchar *otherdb;
+
+	for (other = 0; other < UIDDB_BACKEND_COUNT; other++) {
+		if (other == backend)
+			continue;
+
+		otherdb = g_strconcat(path, G_DIR_SEPARATOR_S,
+				      uiddb_backend_get_filename(other), NULL);
+		if (is_file_exist(otherdb)) {
+			if (!uiddb_backend_available(other))
+				g_warning("Maildir: can't convert %s, backend %s "
+					  "not available\n", otherdb,
+					  uiddb_backend_get_name(other));
+			else if (uiddb_convert(other, otherdb, backend, database) == 0) {
+				g_free(otherdb);
+				return;
+			}
+		}
+		g_free(otherdb);
+	}
+}
+
 static gint open_database(MaildirFolderItem *item)
 {
+	UIDDBBackendType backend;
 	gchar *path, *database;
 
-	g_return_val_if_fail(item->db == NULL, -1);
-	
+	if (item->db != NULL) {
+		/* cached handle: move it to the front of the LRU list */
+		g_queue_unlink(&open_databases, item->db_link);
+		g_queue_push_head_link(&open_databases, item->db_link);
+		item->db_users++;
+		return 0;
+	}
+
+	evict_databases();
+
+	backend = MAILDIR_FOLDER(FOLDER_ITEM(item)->folder)->uiddb_backend;
 	path = maildir_item_get_path(FOLDER_ITEM(item)->folder, FOLDER_ITEM(item));
-	Xstrcat_a(database, path, G_DIR_SEPARATOR_S "sylpheed_uid.db", return -1);
+	database = g_strconcat(path, G_DIR_SEPARATOR_S,
+			       uiddb_backend_get_filename(backend), NULL);
+	if (!is_file_exist(database))
+		convert_database(path, backend, database);
 	g_free(path);
 
-	item->db = uiddb_open(database);
+	item->db = uiddb_open(backend, database);
+	g_free(database);
 	g_return_val_if_fail(item->db != NULL, -1);
-	
+
+	g_queue_push_head(&open_databases, item);
+	item->db_link = open_databases.head;
+	item->db_users = 1;
+
+	if (database_timer == 0)
+		database_timer = g_timeout_add_seconds(DATABASE_IDLE_TIMEOUT,
+						       database_timeout_cb, NULL);
+
 	return 0;
 }
 
 static void close_database(MaildirFolderItem *item)
 {
         g_return_if_fail(item->db != NULL);
-	
-	uiddb_close(item->db);
-	item->db = NULL;
+	g_return_if_fail(item->db_users > 0);
+
+	/* the handle stays open until it is evicted or idle for too long */
+	item->db_users--;
+	item->db_last_used = time(NULL);
+	if (uiddb_take_changed(item->db))
+		item->db_mtime = item->db_last_used;
+}
+
+/* The UIDDB writes changes behind, make sure they reach the disk when
+ * the user leaves the folder, together with the summary cache */
+static void maildir_item_closed(Folder *folder, FolderItem *_item)
+{
+	MaildirFolderItem *item = MAILDIR_FOLDERITEM(_item);
+
+	flush_flag_changes(item);
+	if (item->db != NULL)
+		uiddb_flush(item->db);
+	save_summary_cache(item);
+}
+
+void maildir_close_all_databases(void)
+{
+	while (open_databases.head != NULL) {
+		MaildirFolderItem *item = open_databases.head->data;
+
+		item->db_users = 0;
+		release_database(item);
+	}
+
+	if (database_timer != 0) {
+		g_source_remove(database_timer);
+		database_timer = 0;
+	}
 }
 
 static FolderItem *maildir_item_new(Folder *folder)
@@ -188,6 +538,10 @@ static FolderItem *maildir_item_new(Folder *folder)
         item = g_new0(MaildirFolderItem, 1);
         item->lastuid = 0;
 	item->db = NULL;
+	item->db_users = 0;
+	item->db_link = NULL;
+	item->wd_cur = -1;
+	item->wd_new = -1;
         
         return (FolderItem *) item;
 
@@ -198,6 +552,22 @@ static void maildir_item_destroy(Folder *folder, FolderItem *_item)
         MaildirFolderItem *item = (MaildirFolderItem *)_item;
 
         g_return_if_fail(item != NULL);
+
+	unwatch_item(item);
+	flush_flag_changes(item);
+	if (item->flag_changes != NULL)
+		g_hash_table_destroy(item->flag_changes);
+	if (item->scan_flags != NULL)
+		g_hash_table_destroy(item->scan_flags);
+	if (item->db != NULL) {
+		item->db_users = 0;
+		release_database(item);
+	}
+	if (item->summary != NULL)
+		summary_cache_close(item->summary);
+	if (item->uidlist != NULL)
+		uidlist_free(item->uidlist);
+	free_unlisted(item);
 	
         g_free(item);
 }
@@ -235,72 +605,272 @@ static gchar *maildir_item_get_path(Folder *folder, FolderItem *item)
 	return real_path;
 }
 
-static void build_tree(GNode *node, glob_t *globbuf)
+#ifndef DT_UNKNOWN
+#define DT_UNKNOWN	0
+#define DT_DIR		4
+#define DT_LNK		10
+#endif
+
+#ifdef __linux__
+struct linux_dirent64
 {
-        int i;
-	FolderItem *parent = FOLDER_ITEM(node->data);
-	gchar *prefix = parent->path ?  filename_from_utf8(parent->path) : g_strdup("");
-	Folder *folder = parent->folder;
+	guint64		d_ino;
+	gint64		d_off;
+	unsigned short	d_reclen;
+	unsigned char	d_type;
+	gchar		d_name[];
+};
+#endif
 
-        for (i = 0; i < globbuf->gl_pathc; i++) {
-		FolderItem *newitem;
-		GNode *newnode;
-		gchar *dirname;
-		gchar *foldername;
-		gchar *tmpstr, *dirname_utf8, *foldername_utf8;
-		gboolean res;
+/* Streams the entries of a maildir directory without keeping more
+ * than one buffer of directory entries in memory. */
+struct DirStream
+{
+	gint	 fd;
+#ifdef __linux__
+	gchar	 buf[32768] __attribute__ ((aligned(8)));
+	glong	 pos;
+	glong	 len;
+#else
+	DIR	*dp;
+#endif
+};
 
-		dirname = g_path_get_basename(globbuf->gl_pathv[i]);
-		foldername = &(dirname[strlen(prefix) + 1]);
+static gint open_subdir(const gchar *path, const gchar *subdir)
+{
+	gchar *dirname;
+	gint fd;
 
-                if (dirname[0] == '.' && dirname[1] == '\0') {
-			g_free(dirname);
-                        continue;
-		}
-                if (strncmp(dirname, prefix, strlen(prefix))) {
-			g_free(dirname);
-                        continue;
-		}
-                if (dirname[strlen(prefix)] != '.') {
-			g_free(dirname);
-                        continue;
-		}
-                if (strchr(foldername, '.') != NULL) {
-			g_free(dirname);
-                        continue;
-		}
+	dirname = g_strconcat(path, G_DIR_SEPARATOR_S, subdir, NULL);
+	fd = open(dirname, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		FILE_OP_ERROR(dirname, "open");
+	g_free(dirname);
+
+	return fd;
+}
+
+static gboolean dir_stream_open(struct DirStream *stream, const gchar *path,
+				const gchar *subdir)
+{
+	stream->fd = open_subdir(path, subdir);
+	if (stream->fd < 0)
+		return FALSE;
+
+#ifdef __linux__
+	stream->pos = 0;
+	stream->len = 0;
+#else
+	if ((stream->dp = fdopendir(stream->fd)) == NULL) {
+		close(stream->fd);
+		return FALSE;
+	}
+#endif
 
-                if (!is_dir_exist(globbuf->gl_pathv[i])) {
-			g_free(dirname);
-                        continue;
+	return TRUE;
+}
+
+/* Returns the next entry of the directory and its type, DT_UNKNOWN if
+ * the file system doesn't tell, or NULL at the end. The name is only
+ * valid until the next call. */
+static const gchar *dir_stream_read(struct DirStream *stream, guchar *type)
+{
+#ifdef __linux__
+	struct linux_dirent64 *d;
+
+	if (stream->pos >= stream->len) {
+		stream->len = syscall(SYS_getdents64, stream->fd,
+				      stream->buf, sizeof(stream->buf));
+		stream->pos = 0;
+		if (stream->len <= 0)
+			return NULL;
+	}
+
+	d = (struct linux_dirent64 *) (stream->buf + stream->pos);
+	stream->pos += d->d_reclen;
+	*type = d->d_type;
+
+	return d->d_name;
+#else
+	struct dirent *d;
+
+	if ((d = readdir(stream->dp)) == NULL)
+		return NULL;
+#ifdef _DIRENT_HAVE_D_TYPE
+	*type = d->d_type;
+#else
+	*type = DT_UNKNOWN;
+#endif
+
+	return d->d_name;
+#endif
+}
+
+/* Returns the next entry that may be a message, or NULL at the end of
+ * the directory. The name is only valid until the next call. */
+static const gchar *dir_stream_next(struct DirStream *stream)
+{
+	const gchar *name;
+	guchar type;
+
+	while ((name = dir_stream_read(stream, &type)) != NULL) {
+		if (name[0] == '.' || type == DT_DIR)
+			continue;
+		return name;
+	}
+
+	return NULL;
+}
+
+static void dir_stream_close(struct DirStream *stream)
+{
+#ifdef __linux__
+	close(stream->fd);
+#else
+	closedir(stream->dp);
+#endif
+}
+
+static gint folder_name_compare(gconstpointer a, gconstpointer b)
+{
+	return strcmp(*(const gchar **) a, *(const gchar **) b);
+}
+
+/* Returns the sorted directory names of the folders below the root.
+ * Without check the names are not tested for a cur/ directory. */
+static GPtrArray *read_folder_names(const gchar *rootpath, gboolean check)
+{
+	struct DirStream stream;
+	GPtrArray *names;
+	const gchar *name;
+	gchar *curname;
+	struct stat s;
+	guchar type;
+	gint res;
+
+	names = g_ptr_array_new_with_free_func(g_free);
+	if (!dir_stream_open(&stream, rootpath, "."))
+		return names;
+
+	while ((name = dir_stream_read(&stream, &type)) != NULL) {
+		/* skip ".", ".." and names with an empty component */
+		if (name[0] != '.' || name[1] == '\0' || name[1] == '.' ||
+		    name[strlen(name) - 1] == '.')
+			continue;
+		if (type != DT_DIR && type != DT_LNK && type != DT_UNKNOWN)
+			continue;
+		if (!check) {
+			g_ptr_array_add(names, g_strdup(name));
+			continue;
 		}
-		tmpstr = g_strconcat(globbuf->gl_pathv[i], "/cur", NULL);
-                res = is_dir_exist(tmpstr);
-		g_free(tmpstr);
-		if (!res) {
-			g_free(dirname);
-                        continue;
+
+		/* only folders have cur/, a single stat tells both */
+		curname = g_strconcat(name, G_DIR_SEPARATOR_S "cur", NULL);
+		res = fstatat(stream.fd, curname, &s, 0);
+		g_free(curname);
+		if (res == 0 && S_ISDIR(s.st_mode))
+			g_ptr_array_add(names, g_strdup(name));
+	}
+	dir_stream_close(&stream);
+
+	g_ptr_array_sort(names, folder_name_compare);
+
+	return names;
+}
+
+static gboolean is_folder_dir(const gchar *rootpath, const gchar *dirname)
+{
+	gchar *curpath;
+	gboolean res;
+
+	curpath = g_strconcat(rootpath, G_DIR_SEPARATOR_S, dirname,
+			      G_DIR_SEPARATOR_S "cur", NULL);
+	res = is_dir_exist(curpath);
+	g_free(curpath);
+
+	return res;
+}
+
+static gboolean add_item_path_func(GNode *node, gpointer data)
+{
+	FolderItem *item = FOLDER_ITEM(node->data);
+
+	if (item->path != NULL)
+		g_hash_table_insert((GHashTable *) data, item->path, item);
+
+	return FALSE;
+}
+
+/* Adds the folders in names to the tree below rootnode. A name sorts
+ * before the names of its subfolders, so the parent of a folder has
+ * always been seen when the folder is reached. Folders whose parent
+ * doesn't exist are left out.
+ *
+ * In lazy mode the names are unchecked. Only the first two levels are
+ * added, so that the top level folders show whether they have
+ * subfolders, and one more level below folders that were loaded
+ * before. */
+static void build_tree(GNode *rootnode, GPtrArray *names,
+		       const gchar *rootpath, gboolean lazy)
+{
+	FolderItem *rootitem = FOLDER_ITEM(rootnode->data);
+	Folder *folder = rootitem->folder;
+	GHashTable *items, *found;
+	guint i;
+
+	/* the items already in the tree by path, and the ones seen now by
+	 * directory name */
+	items = g_hash_table_new(g_str_hash, g_str_equal);
+	g_node_traverse(rootnode, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+			add_item_path_func, items);
+	found = g_hash_table_new(g_str_hash, g_str_equal);
+
+	for (i = 0; i < names->len; i++) {
+		FolderItem *parent, *newitem;
+		GNode *newnode;
+		gchar *dirname, *foldername;
+		gchar *dirname_utf8, *foldername_utf8;
+
+		dirname = g_ptr_array_index(names, i);
+		foldername = strrchr(dirname, '.');
+		if (foldername == dirname)
+			parent = rootitem;
+		else {
+			*foldername = '\0';
+			parent = g_hash_table_lookup(found, dirname);
+			*foldername = '.';
+			if (parent == NULL)
+				continue;
+			if (lazy && parent->node->parent != rootnode &&
+			    g_hash_table_lookup(items, parent->path) == NULL)
+				continue;
 		}
+		foldername++;
+
+		if (lazy && !is_folder_dir(rootpath, dirname))
+			continue;
+
 		dirname_utf8 = filename_to_utf8(dirname);
 		foldername_utf8 = filename_to_utf8(foldername);
 
 		/* don't add items that already exist in the tree */
-		newitem = folder_find_child_item_by_name(parent, foldername_utf8);
+		newitem = g_hash_table_lookup(items, dirname_utf8);
 		if (newitem == NULL) {
-			newitem = folder_item_new(parent->folder, foldername_utf8, dirname_utf8);
+			newitem = folder_item_new(folder, foldername_utf8, dirname_utf8);
 			newitem->folder = folder;
 
 			newnode = g_node_new(newitem);
 			newitem->node = newnode;
-			g_node_append(node, newnode);
+			g_node_append(parent->node, newnode);
 
             		debug_print("added item %s\n", newitem->path);
 		}
+		g_hash_table_insert(found, dirname, newitem);
 
 		g_free(dirname_utf8);
 		g_free(foldername_utf8);
 
-		if (!parent->path) {
+		if (parent == rootitem) {
 			if (!folder->outbox && !strcmp(dirname, "." OUTBOX_DIR)) {
 				newitem->stype = F_OUTBOX;
 				folder->outbox = newitem;
@@ -315,9 +885,174 @@ static void build_tree(GNode *node, glob_t *globbuf)
 				folder->trash = newitem;
 			}
 		}
-		g_free(dirname);
-                build_tree(newitem->node, globbuf);
-        }
+	}
+
+	g_hash_table_destroy(found);
+	g_hash_table_destroy(items);
+}
+
+/* Index of the first name that doesn't sort before prefix */
+static guint find_first_name(GPtrArray *names, const gchar *prefix)
+{
+	guint lo = 0, hi = names->len, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(g_ptr_array_index(names, mid), prefix) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* Adds the subfolders of parent that are not in the tree yet. The
+ * names of all subfolders of a folder share its name as prefix, so they
+ * are next to each other in the sorted list. */
+static void load_subfolders(FolderItem *parent)
+{
+	Folder *folder = parent->folder;
+	MaildirFolder *mfolder = MAILDIR_FOLDER(folder);
+	FolderItem *newitem;
+	gchar *rootpath, *path, *prefix, *dirname;
+	gchar *dirname_utf8, *foldername_utf8;
+	gsize len;
+	guint i;
+
+	if (parent->path == NULL)
+		return;
+
+	rootpath = folder_item_get_path(FOLDER_ITEM(folder->node->data));
+	if (mfolder->folder_names == NULL)
+		mfolder->folder_names = read_folder_names(rootpath, FALSE);
+
+	path = filename_from_utf8(parent->path);
+	prefix = g_strconcat(path, ".", NULL);
+	len = strlen(prefix);
+	g_free(path);
+
+	for (i = find_first_name(mfolder->folder_names, prefix);
+	     i < mfolder->folder_names->len; i++) {
+		dirname = g_ptr_array_index(mfolder->folder_names, i);
+		if (strncmp(dirname, prefix, len))
+			break;
+		if (strchr(dirname + len, '.') != NULL)
+			continue;
+
+		dirname_utf8 = filename_to_utf8(dirname);
+		foldername_utf8 = filename_to_utf8(dirname + len);
+		if (folder_find_child_item_by_name(parent, foldername_utf8) == NULL &&
+		    is_folder_dir(rootpath, dirname)) {
+			newitem = folder_item_new(folder, foldername_utf8, dirname_utf8);
+			folder_item_append(parent, newitem);
+			debug_print("loaded item %s\n", newitem->path);
+		}
+		g_free(dirname_utf8);
+		g_free(foldername_utf8);
+	}
+
+	g_free(prefix);
+	g_free(rootpath);
+}
+
+/* The directories below the root changed, read the names again when
+ * they are needed */
+static void forget_folder_names(Folder *folder)
+{
+	MaildirFolder *mfolder = MAILDIR_FOLDER(folder);
+
+	if (mfolder->folder_names != NULL) {
+		g_ptr_array_free(mfolder->folder_names, TRUE);
+		mfolder->folder_names = NULL;
+	}
+}
+
+static gboolean load_subfolders_func(GNode *node, gpointer data)
+{
+	load_subfolders(FOLDER_ITEM(node->data));
+
+	return FALSE;
+}
+
+/* Loads all folders below item, for operations on the whole subtree */
+static void load_subtree(FolderItem *item)
+{
+	if (!MAILDIR_FOLDER(item->folder)->lazy)
+		return;
+
+	/* the children are visited after their parent has loaded them */
+	g_node_traverse(item->node, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+			load_subfolders_func, NULL);
+}
+
+/* Called when item is expanded in the folder view. Its subfolders are
+ * there already, load theirs, so that they show whether they can be
+ * expanded. */
+void maildir_item_expanded(FolderItem *item)
+{
+	GNode *node;
+
+	g_return_if_fail(item != NULL);
+
+	if (item->folder->klass != &maildir_class ||
+	    !MAILDIR_FOLDER(item->folder)->lazy)
+		return;
+
+	for (node = item->node->children; node != NULL; node = node->next)
+		load_subfolders(FOLDER_ITEM(node->data));
+}
+
+/* Loads the folders on the way to path, e.g. ".a.b.c" */
+static void load_folder_path(Folder *folder, const gchar *path)
+{
+	FolderItem *item = FOLDER_ITEM(folder->node->data), *child;
+	gchar **names;
+	gint i;
+
+	if (path[0] != '.')
+		return;
+
+	names = g_strsplit(path + 1, ".", 0);
+	for (i = 0; names[i] != NULL; i++) {
+		child = folder_find_child_item_by_name(item, names[i]);
+		if (child == NULL && item->path != NULL) {
+			load_subfolders(item);
+			child = folder_find_child_item_by_name(item, names[i]);
+		}
+		if (child == NULL)
+			break;
+		item = child;
+	}
+	if (names[i] == NULL)
+		load_subfolders(item);
+	g_strfreev(names);
+}
+
+/* Filters can't move messages into folders that are not loaded */
+static void load_filter_targets(Folder *folder)
+{
+	GSList *lists[] = { pre_global_processing, filtering_rules,
+			    post_global_processing };
+	GSList *rule, *action;
+	FilteringAction *filteringaction;
+	gchar *id, *prefix;
+	gint i;
+
+	id = folder_get_identifier(folder);
+	prefix = g_strconcat(id, G_DIR_SEPARATOR_S, NULL);
+	g_free(id);
+
+	for (i = 0; i < G_N_ELEMENTS(lists); i++)
+		for (rule = lists[i]; rule != NULL; rule = rule->next)
+			for (action = ((FilteringProp *) rule->data)->action_list;
+			     action != NULL; action = action->next) {
+				filteringaction = action->data;
+				if (filteringaction->destination != NULL &&
+				    g_str_has_prefix(filteringaction->destination, prefix))
+					load_folder_path(folder,
+						filteringaction->destination + strlen(prefix));
+			}
 
 	g_free(prefix);
 }
@@ -326,8 +1061,8 @@ static gint maildir_scan_tree(Folder *folder)
 {
         FolderItem *rootitem, *inboxitem;
 	GNode *rootnode, *inboxnode;
-        glob_t globbuf;
-	gchar *rootpath, *globpat;
+	GPtrArray *names;
+	gchar *rootpath;
         
         g_return_val_if_fail(folder != NULL, -1);
 
@@ -366,12 +1101,17 @@ static gint maildir_scan_tree(Folder *folder)
 	maildir_create_tree(folder);
 	remove_missing_folder_items(folder);
 
-	globpat = g_strconcat(rootpath, G_DIR_SEPARATOR_S ".*", NULL);
-	globbuf.gl_offs = 0;
-	glob(globpat, 0, NULL, &globbuf);
-	g_free(globpat);
-	build_tree(rootnode, &globbuf);
-	globfree(&globbuf);
+	names = read_folder_names(rootpath, !MAILDIR_FOLDER(folder)->lazy);
+	build_tree(rootnode, names, rootpath, MAILDIR_FOLDER(folder)->lazy);
+	g_free(rootpath);
+
+	if (MAILDIR_FOLDER(folder)->lazy) {
+		if (MAILDIR_FOLDER(folder)->folder_names != NULL)
+			g_ptr_array_free(MAILDIR_FOLDER(folder)->folder_names, TRUE);
+		MAILDIR_FOLDER(folder)->folder_names = names;
+		load_filter_targets(folder);
+	} else
+		g_ptr_array_free(names, TRUE);
 
 	return 0;
 }
@@ -429,51 +1169,140 @@ static MessageData *get_msgdata_for_filename(const gchar *filename)
 	return msgdata;
 }
 
-static guint32 get_uid_for_filename(MaildirFolderItem *item, const gchar *filename)
+static MaildirUidSource get_uidsource(MaildirFolderItem *item)
 {
-	gchar *uniq, *info;
-	MessageData *msgdata;
-	guint32 uid;
+	return MAILDIR_FOLDER(FOLDER_ITEM(item)->folder)->uidsource;
+}
 
-	g_return_val_if_fail(item->db != NULL, 0);
+static UidListType get_uidlist_type(MaildirUidSource source)
+{
+	return source == UIDSOURCE_COURIER ? UIDLIST_COURIER : UIDLIST_DOVECOT;
+}
 
-	uniq = strrchr(filename, G_DIR_SEPARATOR);
-	if (uniq == NULL) {
-		return 0;
-	}
-	uniq++;
+static void free_unlisted(MaildirFolderItem *item)
+{
+	g_slist_foreach(item->unlisted, (GFunc) g_free, NULL);
+	g_slist_free(item->unlisted);
+	item->unlisted = NULL;
+}
 
-	Xstrdup_a(uniq, uniq, return 0);
-	info = strchr(uniq, ':');
-	if (info != NULL)
-		*info++ = '\0';
-	else
-		info = "";
+/* Reads dovecot-uidlist or courierimapuiddb again if the folder follows
+ * the UIDs of the IMAP server and the file changed. A different
+ * UIDVALIDITY means the UIDDB was numbered by somebody else, it starts
+ * over with the server's UIDs then. Returns
+ * TRUE if the UIDs may have changed, *old_uids_valid is cleared if all
+ * of them did. */
+static gboolean update_uidlist(MaildirFolderItem *item, const gchar *path,
+			       gboolean *old_uids_valid)
+{
+	guint32 uidvalidity;
 
-	msgdata = uiddb_get_entry_for_uniq(item->db, uniq);
-	if (msgdata == NULL) {
-		msgdata = get_msgdata_for_filename(filename);
-		if (msgdata == NULL) {
-			return 0;
-		}
-		msgdata->uid = uiddb_get_new_uid(item->db);
+	if (get_uidsource(item) == UIDSOURCE_OWN) {
+		if (item->uidlist == NULL)
+			return FALSE;
+		uidlist_free(item->uidlist);
+		item->uidlist = NULL;
+		return TRUE;
+	}
 
-		uiddb_insert_entry(item->db, msgdata);
-	} else if (strcmp(msgdata->info, info)) {
-		uiddb_delete_entry(item->db, msgdata->uid);
+	if (!uidlist_update(&item->uidlist, get_uidlist_type(get_uidsource(item)), path))
+		return FALSE;
+	if (item->uidlist == NULL)
+		return TRUE;
 
-		g_free(msgdata->info);
-		msgdata->info = g_strdup(info);
+	uidvalidity = uidlist_get_uidvalidity(item->uidlist);
+	if (uiddb_get_uidvalidity(item->db) != uidvalidity) {
+		debug_print("adopting the UIDs of %s\n", path);
+		uiddb_delete_all_entries(item->db);
+		uiddb_set_uidvalidity(item->db, uidvalidity);
+		*old_uids_valid = FALSE;
+	}
+	/* our own UIDs must not take the ones the server hands out */
+	uiddb_raise_last_uid(item->db, uidlist_get_next_uid(item->uidlist) - 1);
 
-		uiddb_insert_entry(item->db, msgdata);
+	return TRUE;
+}
+
+/* Adds the files Dovecot had no UID for to dovecot-uidlist if the folder
+ * is set up to maintain it. Returns TRUE if the list was changed,
+ * *old_uids_valid is cleared like update_uidlist() does. */
+static gboolean register_unlisted(MaildirFolderItem *item, const gchar *path,
+				  gboolean *old_uids_valid)
+{
+	gboolean changed = FALSE;
+
+	if (item->unlisted != NULL && item->uidlist != NULL &&
+	    get_uidsource(item) == UIDSOURCE_DOVECOT_WRITE) {
+		item->unlisted = g_slist_reverse(item->unlisted);
+		if (uidlist_append(UIDLIST_DOVECOT, path, item->unlisted) > 0)
+			changed = update_uidlist(item, path, old_uids_valid);
 	}
+	free_unlisted(item);
 
-	uid = msgdata->uid;
-	uiddb_free_msgdata(msgdata);
+	return changed;
+}
+
+/* Gives uid, which the server assigned to a message, to that message */
+static guint32 claim_uid(MaildirFolderItem *item, guint32 uid)
+{
+	MessageDataView view;
+
+	if (uiddb_view_entry_for_uid(item->db, uid, &view)) {
+		/* the other message gets a new UID when it is seen next */
+		uiddb_delete_entry(item->db, uid);
+		item->renumbered = TRUE;
+	}
 
 	return uid;
 }
 
+/* Returns the UID for the message file name in subdirectory dir (cur
+ * or new), assigning a new one if the message is not known yet. Messages
+ * in the server's UID list get the server's UID. */
+static guint32 get_uid_for_filename(MaildirFolderItem *item, const gchar *dir,
+				    const gchar *name)
+{
+	gchar *uniq, *info;
+	MessageDataView view;
+	MessageData msgdata;
+	guint32 server_uid = 0;
+
+	g_return_val_if_fail(item->db != NULL, 0);
+
+	Xstrdup_a(uniq, name, return 0);
+	info = strchr(uniq, ':');
+	if (info != NULL)
+		*info++ = '\0';
+	else
+		info = "";
+
+	if (item->uidlist != NULL) {
+		server_uid = uidlist_get_uid(item->uidlist, uniq);
+		if (server_uid == 0 && get_uidsource(item) == UIDSOURCE_DOVECOT_WRITE)
+			item->unlisted = g_slist_prepend(item->unlisted, g_strdup(name));
+	}
+
+	if (!uiddb_view_entry_for_uniq(item->db, uniq, &view)) {
+		msgdata.uid = server_uid != 0 ? claim_uid(item, server_uid) :
+			      uiddb_get_new_uid(item->db);
+	} else if (server_uid != 0 && view.uid != server_uid) {
+		uiddb_delete_entry(item->db, view.uid);
+		msgdata.uid = claim_uid(item, server_uid);
+	} else if (!uiddb_view_info_equal(&view, info) || strcmp(view.dir, dir)) {
+		/* the view dies with the next call on the handle */
+		msgdata.uid = view.uid;
+		uiddb_delete_entry(item->db, msgdata.uid);
+	} else
+		return view.uid;
+
+	msgdata.uniq = uniq;
+	msgdata.info = info;
+	msgdata.dir = (gchar *) dir;
+	uiddb_insert_entry(item->db, &msgdata);
+
+	return msgdata.uid;
+}
+
 static MessageData *get_msgdata_for_uid(MaildirFolderItem *item, guint32 uid)
 {
 	MessageData *msgdata;
@@ -569,57 +1398,489 @@ static gint maildir_uid_compare(gconstpointer a, gconstpointer b)
 	guint gint_a = GPOINTER_TO_INT(a);
 	guint gint_b = GPOINTER_TO_INT(b);
 	
-	return (gint_a - gint_b);
+	return (gint_a > gint_b) - (gint_a < gint_b);
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* Applies the changes collected by the watcher to the UIDDB. Returns
+ * TRUE if the database was changed. */
+static gboolean apply_watch_changes(MaildirFolderItem *item)
+{
+	GHashTableIter iter;
+	gpointer key;
+	gboolean changed, flags_valid;
+
+	if (open_database(item) != 0)
+		return FALSE;
+
+	/* the flags of the last scan follow the files one by one */
+	flags_valid = item->scan_flags != NULL &&
+		      item->flags_generation == item->scan_generation;
+
+	g_hash_table_iter_init(&iter, item->added);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		gchar *dir, *name, *info;
+		guint32 uid;
+
+		Xstrdup_a(dir, (gchar *) key, continue);
+		if ((name = strchr(dir, G_DIR_SEPARATOR)) == NULL)
+			continue;
+		*name++ = '\0';
+		uid = get_uid_for_filename(item, dir, name);
+		if (uid != 0 && flags_valid) {
+			info = strchr(name, ':');
+			set_scan_flags(item, uid, info != NULL ? info + 1 : NULL);
+		}
+	}
+	g_hash_table_remove_all(item->added);
+
+	g_hash_table_iter_init(&iter, item->removed);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		MessageDataView view;
+
+		if (uiddb_view_entry_for_uniq(item->db, (gchar *) key, &view)) {
+			if (flags_valid)
+				g_hash_table_remove(item->scan_flags,
+						    GUINT_TO_POINTER(view.uid));
+			uiddb_delete_entry(item->db, view.uid);
+		}
+	}
+	g_hash_table_remove_all(item->removed);
+
+	changed = uiddb_take_changed(item->db);
+	if (changed)
+		item->db_mtime = time(NULL);
+	close_database(item);
+
+	return changed;
+}
+
+static gboolean watch_timeout_cb(gpointer data)
+{
+	GSList *pending, *cur;
+
+	/* don't interfere with an operation that iterates the main loop */
+	for (cur = watch_pending; cur != NULL; cur = g_slist_next(cur))
+		if (MAILDIR_FOLDERITEM(cur->data)->db_users > 0)
+			return TRUE;
+
+	pending = watch_pending;
+	watch_pending = NULL;
+	watch_timer = 0;
+
+	for (cur = pending; cur != NULL; cur = g_slist_next(cur)) {
+		MaildirFolderItem *item = MAILDIR_FOLDERITEM(cur->data);
+
+		if (apply_watch_changes(item) || !item->synced) {
+			debug_print("folder %s changed on disk\n", FOLDER_ITEM(item)->path);
+			folder_item_scan(FOLDER_ITEM(item));
+		}
+	}
+	g_slist_free(pending);
+
+	return FALSE;
+}
+
+static void queue_watch_changes(MaildirFolderItem *item)
+{
+	if (g_slist_find(watch_pending, item) == NULL)
+		watch_pending = g_slist_prepend(watch_pending, item);
+
+	/* restart the timer to collect a whole burst of events */
+	if (watch_timer != 0)
+		g_source_remove(watch_timer);
+	watch_timer = g_timeout_add(WATCH_DEBOUNCE, watch_timeout_cb, NULL);
+}
+
+static void handle_watch_event(struct inotify_event *event)
+{
+	MaildirFolderItem *item;
+	const gchar *dir;
+	gchar *uniq, *info;
+
+	if (event->mask & IN_Q_OVERFLOW) {
+		GHashTableIter iter;
+		gpointer value;
+
+		/* events were lost, the next scan has to read the directories */
+		debug_print("inotify queue overflow\n");
+		g_hash_table_iter_init(&iter, watches);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			MAILDIR_FOLDERITEM(value)->synced = FALSE;
+			queue_watch_changes(MAILDIR_FOLDERITEM(value));
+		}
+		return;
+	}
+
+	item = g_hash_table_lookup(watches, GINT_TO_POINTER(event->wd));
+	if (item == NULL)
+		return;
+
+	if (event->mask & IN_IGNORED) {
+		/* directory is gone */
+		g_hash_table_remove(watches, GINT_TO_POINTER(event->wd));
+		if (event->wd == item->wd_cur)
+			item->wd_cur = -1;
+		else
+			item->wd_new = -1;
+		item->synced = FALSE;
+		item->scan_generation++;
+		return;
+	}
+
+	if (event->len == 0 || event->name[0] == '.' || (event->mask & IN_ISDIR))
+		return;
+
+	dir = event->wd == item->wd_cur ? DIR_CUR : DIR_NEW;
+	Xstrdup_a(uniq, event->name, return);
+	if ((info = strchr(uniq, ':')) != NULL)
+		*info = '\0';
+
+	if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+		g_hash_table_remove(item->removed, uniq);
+		g_hash_table_replace(item->added,
+				     g_strconcat(dir, G_DIR_SEPARATOR_S, event->name, NULL),
+				     NULL);
+	} else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+		gchar *filename;
+
+		filename = g_strconcat(dir, G_DIR_SEPARATOR_S, event->name, NULL);
+		g_hash_table_remove(item->added, filename);
+		g_free(filename);
+		g_hash_table_replace(item->removed, g_strdup(uniq), NULL);
+	}
+
+	queue_watch_changes(item);
+}
+
+static gboolean watch_io_cb(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	gchar buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	gchar *ptr;
+	ssize_t len;
+
+	len = read(inotify_fd, buf, sizeof(buf));
+	if (len == 0)
+		return TRUE;
+	if (len < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return TRUE;
+		FILE_OP_ERROR("inotify", "read");
+		/* the source is removed with the FALSE below */
+		inotify_source = 0;
+		return FALSE;
+	}
+
+	for (ptr = buf; ptr < buf + len; ) {
+		struct inotify_event *event = (struct inotify_event *) ptr;
+
+		handle_watch_event(event);
+		ptr += sizeof(struct inotify_event) + event->len;
+	}
+
+	return TRUE;
+}
+
+static gint add_watch(const gchar *path, const gchar *subdir)
+{
+	gchar *dirname;
+	gint wd;
+
+	dirname = g_strconcat(path, G_DIR_SEPARATOR_S, subdir, NULL);
+	wd = inotify_add_watch(inotify_fd, dirname,
+			       IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM |
+			       IN_DELETE | IN_ONLYDIR);
+	if (wd < 0)
+		FILE_OP_ERROR(dirname, "inotify_add_watch");
+	g_free(dirname);
+
+	return wd;
+}
+
+/* Starts watching cur/ and new/ of item. Returns FALSE if the folder
+ * can't be watched. */
+static gboolean watch_item(MaildirFolderItem *item, const gchar *path)
+{
+	if (item->wd_cur >= 0 && item->wd_new >= 0)
+		return TRUE;
+
+	if (inotify_fd < 0) {
+		GIOChannel *chan;
+
+		inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (inotify_fd < 0) {
+			FILE_OP_ERROR("inotify", "inotify_init1");
+			return FALSE;
+		}
+		watches = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+		chan = g_io_channel_unix_new(inotify_fd);
+		inotify_source = g_io_add_watch(chan, G_IO_IN, watch_io_cb, NULL);
+		g_io_channel_unref(chan);
+	}
+
+	if (item->added == NULL) {
+		item->added = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+		item->removed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	}
+
+	if (item->wd_cur < 0 && (item->wd_cur = add_watch(path, DIR_CUR)) >= 0)
+		g_hash_table_insert(watches, GINT_TO_POINTER(item->wd_cur), item);
+	if (item->wd_new < 0 && (item->wd_new = add_watch(path, DIR_NEW)) >= 0)
+		g_hash_table_insert(watches, GINT_TO_POINTER(item->wd_new), item);
+
+	return item->wd_cur >= 0 && item->wd_new >= 0;
+}
+
+/* Returns TRUE if the watcher has changes of item not applied yet */
+static gboolean has_watch_changes(MaildirFolderItem *item)
+{
+	return g_slist_find(watch_pending, item) != NULL;
+}
+
+static void flush_watch_changes(MaildirFolderItem *item)
+{
+	if (!has_watch_changes(item))
+		return;
+
+	watch_pending = g_slist_remove(watch_pending, item);
+	apply_watch_changes(item);
+}
+
+static void unwatch_item(MaildirFolderItem *item)
+{
+	if (item->wd_cur >= 0) {
+		g_hash_table_remove(watches, GINT_TO_POINTER(item->wd_cur));
+		inotify_rm_watch(inotify_fd, item->wd_cur);
+		item->wd_cur = -1;
+	}
+	if (item->wd_new >= 0) {
+		g_hash_table_remove(watches, GINT_TO_POINTER(item->wd_new));
+		inotify_rm_watch(inotify_fd, item->wd_new);
+		item->wd_new = -1;
+	}
+	item->synced = FALSE;
+	watch_pending = g_slist_remove(watch_pending, item);
+
+	if (item->added != NULL) {
+		g_hash_table_destroy(item->added);
+		g_hash_table_destroy(item->removed);
+		item->added = NULL;
+		item->removed = NULL;
+	}
+}
+
+void maildir_watch_done(void)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	if (watch_timer != 0) {
+		g_source_remove(watch_timer);
+		watch_timer = 0;
+	}
+	g_slist_free(watch_pending);
+	watch_pending = NULL;
+
+	if (inotify_fd < 0)
+		return;
+
+	g_hash_table_iter_init(&iter, watches);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		MAILDIR_FOLDERITEM(value)->wd_cur = -1;
+		MAILDIR_FOLDERITEM(value)->wd_new = -1;
+		MAILDIR_FOLDERITEM(value)->synced = FALSE;
+	}
+
+	if (inotify_source != 0)
+		g_source_remove(inotify_source);
+	inotify_source = 0;
+	close(inotify_fd);
+	inotify_fd = -1;
+	g_hash_table_destroy(watches);
+	watches = NULL;
+}
+#else
+static gboolean watch_item(MaildirFolderItem *item, const gchar *path)
+{
+	return FALSE;
+}
+
+static gboolean has_watch_changes(MaildirFolderItem *item)
+{
+	return FALSE;
+}
+
+static void flush_watch_changes(MaildirFolderItem *item)
+{
+}
+
+static void unwatch_item(MaildirFolderItem *item)
+{
+}
+
+void maildir_watch_done(void)
+{
+}
+#endif
+
+/* MsgPermFlags for the FLAGGED, PASSED, REPLIED and SEEN bits of a
+ * record, indexed by (flags >> 1) & 0xf */
+#define INFO_PERM_FLAGS(i) \
+	(((i) & 8 ? 0 : MSG_UNREAD) | ((i) & 1 ? MSG_MARKED : 0) | \
+	 ((i) & 2 ? MSG_FORWARDED : 0) | ((i) & 4 ? MSG_REPLIED : 0))
+
+static const MsgPermFlags info_perm_flags[16] = {
+	INFO_PERM_FLAGS(0),  INFO_PERM_FLAGS(1),  INFO_PERM_FLAGS(2),
+	INFO_PERM_FLAGS(3),  INFO_PERM_FLAGS(4),  INFO_PERM_FLAGS(5),
+	INFO_PERM_FLAGS(6),  INFO_PERM_FLAGS(7),  INFO_PERM_FLAGS(8),
+	INFO_PERM_FLAGS(9),  INFO_PERM_FLAGS(10), INFO_PERM_FLAGS(11),
+	INFO_PERM_FLAGS(12), INFO_PERM_FLAGS(13), INFO_PERM_FLAGS(14),
+	INFO_PERM_FLAGS(15)
+};
+
+/* Decodes the flags of the info part of a file name like the UIDDB
+ * does, returns -1 if it has none */
+static gint get_flags_for_info(const gchar *info, MsgPermFlags *flags)
+{
+	guint bits = 0;
+
+	if (info[0] != '2' || info[1] != ',')
+		return -1;
+
+	for (info += 2; *info != '\0'; info++) {
+		switch (*info) {
+		case 'F': bits |= 1; break;
+		case 'P': bits |= 2; break;
+		case 'R': bits |= 4; break;
+		case 'S': bits |= 8; break;
+		}
+	}
+	*flags = info_perm_flags[bits];
+
+	return 0;
+}
+
+static void set_scan_flags(MaildirFolderItem *item, guint32 uid, const gchar *info)
+{
+	MsgPermFlags flags;
+
+	if (info == NULL || get_flags_for_info(info, &flags) < 0)
+		flags = SCAN_FLAGS_NONE;
+	g_hash_table_insert(item->scan_flags, GUINT_TO_POINTER(uid),
+			    GUINT_TO_POINTER(flags));
+}
+
+/* Returns the UIDs of all messages in cur/ and new/ and remembers their
+ * flags for get_flags */
+static MsgNumberList *scan_messages(MaildirFolderItem *item, const gchar *path)
+{
+	static const gchar *subdirs[] = { DIR_CUR, DIR_NEW };
+	MsgNumberList *uids = NULL;
+	const gchar *info;
+	int i;
+
+	item->scan_generation++;
+	if (item->scan_flags == NULL)
+		item->scan_flags = g_hash_table_new(g_direct_hash, g_direct_equal);
+	else
+		g_hash_table_remove_all(item->scan_flags);
+
+	for (i = 0; i < G_N_ELEMENTS(subdirs); i++) {
+		struct DirStream stream;
+		const gchar *name;
+
+		if (!dir_stream_open(&stream, path, subdirs[i]))
+			continue;
+
+		while ((name = dir_stream_next(&stream)) != NULL) {
+			guint32 uid;
+
+			uid = get_uid_for_filename(item, subdirs[i], name);
+			if (uid != 0) {
+				uids = g_slist_prepend(uids, GINT_TO_POINTER(uid));
+				info = strchr(name, ':');
+				set_scan_flags(item, uid, info != NULL ? info + 1 : NULL);
+			}
+		}
+
+		dir_stream_close(&stream);
+	}
+	item->flags_generation = item->scan_generation;
+
+	return uids;
 }
 
 static gint maildir_get_num_list(Folder *folder, FolderItem *item,
 				 MsgNumberList ** list, gboolean *old_uids_valid)
 {
-	gchar *path, *globpattern;
-	glob_t globbuf;
-	int i;
-	MsgNumberList * tail;
+	MaildirFolderItem *mitem = MAILDIR_FOLDERITEM(item);
+	MsgNumberList *uids = NULL;
+	gchar *path;
 
-        g_return_val_if_fail(open_database(MAILDIR_FOLDERITEM(item)) == 0, -1);
+        flush_flag_changes(mitem);
+        g_return_val_if_fail(open_database(mitem) == 0, -1);
 
 	*old_uids_valid = TRUE;
-
-	globbuf.gl_offs = 0;
 	path = maildir_item_get_path(folder, item);
 
-	globpattern = g_strconcat(path, G_DIR_SEPARATOR_S, DIR_CUR, G_DIR_SEPARATOR_S, "*", NULL);
-	glob(globpattern, GLOB_NOSORT, NULL, &globbuf);
-	g_free(globpattern);
-
-	globpattern = g_strconcat(path, G_DIR_SEPARATOR_S, DIR_NEW, G_DIR_SEPARATOR_S, "*", NULL);
-	glob(globpattern, GLOB_NOSORT | GLOB_APPEND, NULL, &globbuf);
-	g_free(globpattern);
+	flush_watch_changes(mitem);
+	/* the server's UIDs and the ones of files it doesn't know yet can
+	 * change without a change in cur/ or new/ */
+	if (update_uidlist(mitem, path, old_uids_valid) ||
+	    mitem->unlisted != NULL || mitem->renumbered)
+		mitem->synced = FALSE;
+	free_unlisted(mitem);
+	/* a UID given to another message leaves stale data cached for it */
+	if (mitem->renumbered)
+		*old_uids_valid = FALSE;
+
+	if (mitem->synced) {
+		/* the watcher kept the UIDDB up to date */
+		*list = g_slist_concat(*list, uiddb_get_uids(mitem->db));
+		*list = g_slist_sort(*list, maildir_uid_compare);
 
-	g_free(path);
+		g_free(path);
+		close_database(mitem);
+		return g_slist_length(*list);
+	}
 
-	tail = g_slist_last(*list);
-	
-	for (i = 0; i < globbuf.gl_pathc; i++) {
-		guint32 uid;
+	/* watch before reading, so no change can slip through */
+	mitem->synced = watch_item(mitem, path);
 
-		uid = get_uid_for_filename((MaildirFolderItem *) item, globbuf.gl_pathv[i]);
-		if (uid != 0) {
-			tail = g_slist_append(tail, GINT_TO_POINTER(uid));
-			tail = g_slist_last(tail);
-			if (!*list) *list = tail;
-		}
+	mitem->renumbered = FALSE;
+	uids = scan_messages(mitem, path);
+	if (register_unlisted(mitem, path, old_uids_valid) || mitem->renumbered) {
+		/* UIDs moved between messages, number them once more */
+		g_slist_free(uids);
+		uids = scan_messages(mitem, path);
+		free_unlisted(mitem);
 	}
-	globfree(&globbuf);
+	if (mitem->renumbered)
+		*old_uids_valid = FALSE;
+	mitem->renumbered = FALSE;
 
+	g_free(path);
+
+	*list = g_slist_concat(*list, uids);
 	*list = g_slist_sort(*list, maildir_uid_compare);
 
-	uiddb_delete_entries_not_in_list(((MaildirFolderItem *) item)->db, *list);
+	uiddb_delete_entries_not_in_list(mitem->db, *list);
 
-	close_database(MAILDIR_FOLDERITEM(item));
+	close_database(mitem);
 	return g_slist_length(*list);
 }
 
-static MsgInfo *maildir_parse_msg(const gchar *file, FolderItem *item)
+/* queued messages and drafts carry Claws' own headers */
+static gboolean use_headerscan(FolderItem *item)
+{
+	return item->stype != F_QUEUE && item->stype != F_DRAFT;
+}
+
+/* Parses the message in file, from the header in block if it was read
+ * already */
+static MsgInfo *parse_msg_block(const gchar *file, FolderItem *item,
+				const HeaderBlock *block)
 {
 	MsgInfo *msginfo;
 	MsgFlags flags;
@@ -627,16 +1888,17 @@ static MsgInfo *maildir_parse_msg(const gchar *file, FolderItem *item)
 	flags.perm_flags = MSG_NEW|MSG_UNREAD;
 	flags.tmp_flags = 0;
 
-	g_return_val_if_fail(item != NULL, NULL);
-	g_return_val_if_fail(file != NULL, NULL);
-
 	if (item->stype == F_QUEUE) {
 		MSG_SET_TMP_FLAGS(flags, MSG_QUEUED);
 	} else if (item->stype == F_DRAFT) {
 		MSG_SET_TMP_FLAGS(flags, MSG_DRAFT);
 	}
 
-	msginfo = procheader_parse_file(file, flags, FALSE, FALSE);
+	msginfo = NULL;
+	if (block != NULL)
+		msginfo = headerscan_parse_block(block, flags);
+	if (!msginfo)
+		msginfo = procheader_parse_file(file, flags, FALSE, FALSE);
 	if (!msginfo) return NULL;
 
 	msginfo->msgnum = atoi(file);
@@ -657,6 +1919,22 @@ static MsgInfo *maildir_parse_msg(const gchar *file, FolderItem *item)
 	return msginfo;
 }
 
+static MsgInfo *maildir_parse_msg(const gchar *file, FolderItem *item)
+{
+	HeaderBlock *block = NULL;
+	MsgInfo *msginfo;
+
+	g_return_val_if_fail(item != NULL, NULL);
+	g_return_val_if_fail(file != NULL, NULL);
+
+	if (use_headerscan(item))
+		block = headerscan_read_file(file);
+	msginfo = parse_msg_block(file, item, block);
+	headerscan_free_block(block);
+
+	return msginfo;
+}
+
 static gboolean maildir_scan_required(Folder * folder, FolderItem * item) {
 	gchar *path, *database;
 	struct stat my_stat;
@@ -664,9 +1942,15 @@ static gboolean maildir_scan_required(Folder * folder, FolderItem * item) {
 	gboolean result = FALSE;
 
 	path = maildir_item_get_path(FOLDER_ITEM(item)->folder, FOLDER_ITEM(item));
-	Xstrcat_a(database, path, G_DIR_SEPARATOR_S "sylpheed_uid.db", return -1);
+	Xstrcat_a(database, path, G_DIR_SEPARATOR_S, return -1);
+	Xstrcat_a(database, database,
+		  uiddb_backend_get_filename(MAILDIR_FOLDER(folder)->uiddb_backend),
+		  return -1);
 	if (lstat(database, &my_stat)) { goto OUTTAHERE; }
 	db_time = my_stat.st_mtime;
+	/* changes through a cached handle may not have reached the file yet */
+	if (MAILDIR_FOLDERITEM(item)->db_mtime > db_time)
+		db_time = MAILDIR_FOLDERITEM(item)->db_mtime;
 
 	Xstrcat_a(database, path, G_DIR_SEPARATOR_S "new", return -1);
 	if (lstat(database, &my_stat)) { goto OUTTAHERE; }
@@ -676,212 +1960,1285 @@ static gboolean maildir_scan_required(Folder * folder, FolderItem * item) {
 		if (lstat(database, &my_stat)) { goto OUTTAHERE; }
 		result = my_stat.st_mtime > db_time;
 	}
+	if (!result && MAILDIR_FOLDER(folder)->uidsource != UIDSOURCE_OWN) {
+		Xstrcat_a(database, path, G_DIR_SEPARATOR_S, return -1);
+		Xstrcat_a(database, database,
+			  uidlist_get_filename(get_uidlist_type(MAILDIR_FOLDER(folder)->uidsource)),
+			  return -1);
+		if (lstat(database, &my_stat)) { goto OUTTAHERE; }
+		result = my_stat.st_mtime > db_time;
+	}
 OUTTAHERE:
 	g_free(path);
 
-	return result;
+	return result;
+}
+
+/* Returns the MsgInfo of file from the summary cache if the file didn't
+ * change since it was parsed */
+static MsgInfo *lookup_summary(MaildirFolderItem *item, const gchar *file,
+			       const gchar *uniq)
+{
+	MsgInfo *msginfo;
+	struct stat s;
+
+	if (stat(file, &s) < 0)
+		return NULL;
+
+	msginfo = summary_cache_get(get_summary_cache(item), uniq, s.st_size, s.st_mtime);
+	if (msginfo != NULL)
+		msginfo->folder = FOLDER_ITEM(item);
+
+	return msginfo;
+}
+
+static MsgInfo *maildir_get_msginfo(Folder * folder,
+				    FolderItem * item, gint num)
+{
+	MsgInfo *msginfo;
+	gchar *file, *uniq, *info;
+
+	g_return_val_if_fail(item != NULL, NULL);
+	g_return_val_if_fail(num > 0, NULL);
+	g_return_val_if_fail(open_database(MAILDIR_FOLDERITEM(item)) == 0, NULL);
+
+	file = maildir_fetch_msg(folder, item, num);
+	if (!file) {
+		close_database(MAILDIR_FOLDERITEM(item));
+		return NULL;
+	}
+
+	uniq = g_path_get_basename(file);
+	if ((info = strchr(uniq, ':')) != NULL)
+		*info = '\0';
+
+	msginfo = lookup_summary(MAILDIR_FOLDERITEM(item), file, uniq);
+	if (msginfo == NULL) {
+		msginfo = maildir_parse_msg(file, item);
+		if (msginfo)
+			summary_cache_put(get_summary_cache(MAILDIR_FOLDERITEM(item)),
+					  uniq, msginfo);
+	}
+	if (msginfo)
+		msginfo->msgnum = num;
+
+	g_free(uniq);
+	g_free(file);
+	close_database(MAILDIR_FOLDERITEM(item));
+
+	return msginfo;
+}
+
+struct ParseJob
+{
+	FolderItem	*item;
+	gchar		*file;
+	gchar		*uniq;
+	guint32		 uid;
+	HeaderBlock	*block;		/* read by a reader thread */
+	MsgInfo		*msginfo;
+	gboolean	 cached;	/* msginfo came from the summary cache */
+};
+
+/* Runs in a reader thread: only reads the header, the parser uses
+ * codeconv and procheader, which are not reentrant */
+static void read_job_func(gpointer data, gpointer user_data)
+{
+	struct ParseJob *job = data;
+
+	job->block = headerscan_read_file(job->file);
+	g_async_queue_push((GAsyncQueue *) user_data, job);
+}
+
+static void parse_job(struct ParseJob *job)
+{
+	job->msginfo = parse_msg_block(job->file, job->item, job->block);
+	headerscan_free_block(job->block);
+	job->block = NULL;
+}
+
+/* Parses the jobs in this thread while reader threads read the headers
+ * of the next ones */
+static void parse_jobs(struct ParseJob *jobs, guint njobs)
+{
+	GThreadPool *pool = NULL;
+	GAsyncQueue *done = NULL;
+	guint i, nthreads, pending = 0;
+
+	nthreads = MIN(g_get_num_processors(), PARSE_THREADS_MAX);
+	if (njobs >= PARSE_THREADS_MIN_JOBS && nthreads > 1 &&
+	    use_headerscan(jobs[0].item)) {
+		done = g_async_queue_new();
+		pool = g_thread_pool_new(read_job_func, done, nthreads, TRUE, NULL);
+	}
+
+	for (i = 0; i < njobs || pending > 0; ) {
+		/* keep a bounded number of headers read ahead */
+		if (i < njobs && pending < PARSE_READ_AHEAD) {
+			if (jobs[i].cached) {
+				i++;
+				continue;
+			}
+			if (pool != NULL && g_thread_pool_push(pool, &jobs[i], NULL)) {
+				pending++;
+			} else {
+				if (use_headerscan(jobs[i].item))
+					jobs[i].block = headerscan_read_file(jobs[i].file);
+				parse_job(&jobs[i]);
+			}
+			i++;
+			continue;
+		}
+		parse_job(g_async_queue_pop(done));
+		pending--;
+	}
+
+	if (pool != NULL) {
+		g_thread_pool_free(pool, FALSE, TRUE);
+		g_async_queue_unref(done);
+	}
+}
+
+static MsgInfoList *maildir_get_msginfos(Folder *folder, FolderItem *_item,
+					 MsgNumberList *msgnum_list)
+{
+	MaildirFolderItem *item = MAILDIR_FOLDERITEM(_item);
+	MsgNumberList *sorted;
+	MsgInfoList *ret = NULL;
+	GSList *entries, *cur;
+	struct ParseJob *jobs;
+	guint i, njobs;
+	gchar *path;
+
+	g_return_val_if_fail(folder != NULL, NULL);
+	g_return_val_if_fail(item != NULL, NULL);
+	g_return_val_if_fail(open_database(item) == 0, NULL);
+
+	sorted = g_slist_sort(g_slist_copy(msgnum_list), maildir_uid_compare);
+	entries = uiddb_get_entries_for_uids(item->db, sorted);
+	g_slist_free(sorted);
+
+	path = maildir_item_get_path(folder, _item);
+	njobs = g_slist_length(entries);
+	jobs = g_new0(struct ParseJob, njobs);
+	for (cur = entries, i = 0; cur != NULL; cur = g_slist_next(cur), i++) {
+		MessageData *msgdata = (MessageData *) cur->data;
+		gchar *msgname;
+
+		msgname = get_filename_for_msgdata(msgdata);
+		jobs[i].item = _item;
+		jobs[i].uid = msgdata->uid;
+		jobs[i].file = g_strconcat(path, G_DIR_SEPARATOR_S, msgname, NULL);
+		jobs[i].msginfo = lookup_summary(item, jobs[i].file, msgdata->uniq);
+		jobs[i].cached = jobs[i].msginfo != NULL;
+		/* the MessageData is freed below, keep the uniq */
+		jobs[i].uniq = msgdata->uniq;
+		msgdata->uniq = NULL;
+		g_free(msgname);
+		uiddb_free_msgdata(msgdata);
+	}
+	g_slist_free(entries);
+	g_free(path);
+
+	parse_jobs(jobs, njobs);
+
+	for (i = 0; i < njobs; i++) {
+		MsgInfo *msginfo = jobs[i].msginfo;
+
+		/* the file was renamed by another program: search for it */
+		if (msginfo == NULL) {
+			gchar *file = get_filepath_for_uid(item, jobs[i].uid);
+
+			if (file != NULL)
+				msginfo = maildir_parse_msg(file, _item);
+			g_free(file);
+		}
+		if (msginfo != NULL) {
+			if (!jobs[i].cached)
+				summary_cache_put(get_summary_cache(item), jobs[i].uniq, msginfo);
+			msginfo->msgnum = jobs[i].uid;
+			ret = g_slist_prepend(ret, msginfo);
+		}
+		g_free(jobs[i].file);
+		g_free(jobs[i].uniq);
+	}
+	g_free(jobs);
+
+	close_database(item);
+
+	return g_slist_reverse(ret);
+}
+
+static gchar *maildir_fetch_msg(Folder * folder, FolderItem * item,
+				gint num)
+{
+	gchar *filename;
+	
+        g_return_val_if_fail(open_database(MAILDIR_FOLDERITEM(item)) == 0, NULL);
+	filename = get_filepath_for_uid((MaildirFolderItem *) item, num);
+	close_database(MAILDIR_FOLDERITEM(item));
+	
+	return filename;
+}
+
+static gchar *generate_uniq()
+{
+	gchar hostname[32], *strptr;
+	static gint q = 1;
+	struct timeval tv;
+
+	gethostname(hostname, 32);
+	hostname[31] = '\0';
+
+	strptr = &hostname[0];
+	while (*strptr != '\0') {
+		if (*strptr == '/')
+			*strptr = '\057';
+		if (*strptr == ':')
+			*strptr = '\072';
+		strptr++;
+	}
+
+	gettimeofday(&tv, NULL);
+
+	return g_strdup_printf("%d.P%dQ%dM%d.%s", (int) tv.tv_sec, getpid(), q++, (int) tv.tv_usec, hostname);
+}
+
+static gchar *get_infostr(MsgPermFlags permflags)
+{
+	if (permflags & MSG_NEW)
+		return g_strdup("");
+
+	return g_strconcat("2,",
+		  permflags & MSG_MARKED    ? "F" : "",
+		  permflags & MSG_FORWARDED ? "P" : "",
+		  permflags & MSG_REPLIED   ? "R" : "",
+		!(permflags & MSG_UNREAD)   ? "S" : "",
+		NULL);
+}
+
+/* Returns whether file is a message in cur/ or new/ of a folder in the
+ * Maildir++ tree of item. Such files never change, so a copy can share
+ * them with a hardlink. */
+static gboolean is_message_in_tree(MaildirFolderItem *item, const gchar *file)
+{
+	Folder *folder = FOLDER_ITEM(item)->folder;
+	gchar *root, *dir;
+	gsize len;
+	gboolean result = FALSE;
+
+	if (folder->node == NULL)
+		return FALSE;
+
+	root = maildir_item_get_path(folder, FOLDER_ITEM(folder->node->data));
+	len = strlen(root);
+	if (!strncmp(file, root, len) && file[len] == G_DIR_SEPARATOR) {
+		dir = g_path_get_dirname(file);
+		result = g_str_has_suffix(dir, G_DIR_SEPARATOR_S DIR_CUR) ||
+			 g_str_has_suffix(dir, G_DIR_SEPARATOR_S DIR_NEW);
+		g_free(dir);
+	}
+	g_free(root);
+
+	return result;
+}
+
+/* Copies the rest of in to out, inside the kernel if possible */
+static gboolean copy_file_data(gint in, gint out)
+{
+	gchar *buf;
+	ssize_t r = 0, w;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	while ((r = copy_file_range(in, NULL, out, NULL, COPY_BUFFER_SIZE * 16, 0)) > 0)
+		;
+	if (r == 0)
+		return TRUE;
+	/* not supported between these files, continue where it stopped */
+	if (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+	    errno != EOPNOTSUPP && errno != EBADF)
+		return FALSE;
+#endif
+
+	buf = g_malloc(COPY_BUFFER_SIZE);
+	while ((r = read(in, buf, COPY_BUFFER_SIZE)) != 0) {
+		gchar *p = buf;
+
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		while (r > 0) {
+			if ((w = write(out, p, r)) < 0) {
+				if (errno == EINTR)
+					continue;
+				break;
+			}
+			p += w;
+			r -= w;
+		}
+		if (r > 0)
+			break;
+	}
+	g_free(buf);
+
+	return r == 0;
+}
+
+/* Copies the message file src to the new file dest. A reflink shares
+ * the data on file systems that support it, otherwise the data is copied
+ * with copy_file_range or through a large buffer. */
+static gint copy_message_file(const gchar *src, const gchar *dest)
+{
+	gint in, out;
+	gboolean ok;
+
+	if ((in = open(src, O_RDONLY)) < 0) {
+		FILE_OP_ERROR(src, "open");
+		return -1;
+	}
+	if ((out = open(dest, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0) {
+		FILE_OP_ERROR(dest, "open");
+		close(in);
+		return -1;
+	}
+
+#ifdef FICLONE
+	ok = ioctl(out, FICLONE, in) == 0 || copy_file_data(in, out);
+#else
+	ok = copy_file_data(in, out);
+#endif
+	if (!ok)
+		FILE_OP_ERROR(dest, "copy");
+
+	close(in);
+	if (close(out) < 0)
+		ok = FALSE;
+	if (!ok) {
+		unlink(dest);
+		return -1;
+	}
+
+	return 0;
+}
+
+static MaildirSyncPolicy get_sync_policy(MaildirFolderItem *item)
+{
+	return MAILDIR_FOLDER(FOLDER_ITEM(item)->folder)->sync_policy;
+}
+
+/* Writes the data of file to disk */
+static void sync_file(const gchar *file)
+{
+	gint fd;
+
+	if ((fd = open(file, O_RDONLY)) < 0)
+		return;
+	if (fdatasync(fd) < 0)
+		FILE_OP_ERROR(file, "fdatasync");
+	close(fd);
+}
+
+/* Writes the entries of the subdirectory of item to disk */
+static void sync_dir(MaildirFolderItem *item, const gchar *subdir)
+{
+	gchar *path;
+	gint fd;
+
+	path = maildir_item_get_path(FOLDER_ITEM(item)->folder, FOLDER_ITEM(item));
+	if ((fd = open_subdir(path, subdir)) >= 0) {
+		if (fsync(fd) < 0)
+			FILE_OP_ERROR(subdir, "fsync");
+		close(fd);
+	}
+	g_free(path);
+}
+
+/* Remembers the subdirectory of item in dirs (a set of paths) to be
+ * synced later by sync_dirs() */
+static void defer_sync_dir(GHashTable *dirs, MaildirFolderItem *item, const gchar *subdir)
+{
+	gchar *path, *dirname;
+
+	path = maildir_item_get_path(FOLDER_ITEM(item)->folder, FOLDER_ITEM(item));
+	dirname = g_strconcat(path, G_DIR_SEPARATOR_S, subdir, NULL);
+	g_free(path);
+
+	/* the set owns its keys, a duplicate one is freed */
+	g_hash_table_insert(dirs, dirname, GINT_TO_POINTER(1));
+}
+
+static void sync_dirs_func(gpointer key, gpointer value, gpointer data)
+{
+	const gchar *dirname = (const gchar *) key;
+	gint fd;
+
+	if ((fd = open(dirname, O_RDONLY | O_DIRECTORY)) < 0) {
+		FILE_OP_ERROR(dirname, "open");
+		return;
+	}
+	if (fsync(fd) < 0)
+		FILE_OP_ERROR(dirname, "fsync");
+	close(fd);
+}
+
+/* Syncs each directory collected by defer_sync_dir() once */
+static void sync_dirs(GHashTable *dirs)
+{
+	g_hash_table_foreach(dirs, sync_dirs_func, NULL);
+}
+
+static gchar *get_tmppath_for_msgdata(MaildirFolderItem *item, MessageData *msgdata)
+{
+	gchar *dir = msgdata->dir, *tmpname;
+
+	msgdata->dir = DIR_TMP;
+	tmpname = get_filepath_for_msgdata(item, msgdata);
+	msgdata->dir = dir;
+
+	return tmpname;
+}
+
+/* Writes the data of the messages in tmp/ to disk, with a single syncfs
+ * for larger batches */
+static void sync_tmp_files(MaildirFolderItem *item, GSList *msgdata_list)
+{
+	GSList *cur;
+
+#ifdef HAVE_SYNCFS
+	if (g_slist_length(msgdata_list) >= SYNCFS_MIN_BATCH) {
+		gchar *path;
+		gint fd, ret = -1;
+
+		path = maildir_item_get_path(FOLDER_ITEM(item)->folder, FOLDER_ITEM(item));
+		if ((fd = open_subdir(path, DIR_TMP)) >= 0) {
+			ret = syncfs(fd);
+			close(fd);
+		}
+		g_free(path);
+		if (ret == 0)
+			return;
+	}
+#endif
+
+	for (cur = msgdata_list; cur != NULL; cur = g_slist_next(cur)) {
+		gchar *tmpname = get_tmppath_for_msgdata(item, (MessageData *) cur->data);
+
+		sync_file(tmpname);
+		g_free(tmpname);
+	}
+}
+
+/* Puts file into tmp/ of item under a new uniq. The MessageData returned
+ * describes the message after commit_delivery(). */
+static MessageData *deliver_file_to_tmp(MaildirFolderItem *item, const gchar *file,
+					MsgFlags *flags, guint32 uid)
+{
+	MessageData *msgdata;
+	gchar *tmpname;
+
+	msgdata = g_new0(MessageData, 1);
+	msgdata->uniq = generate_uniq();
+	if (flags != NULL)
+		msgdata->info = get_infostr(flags->perm_flags);
+	else
+		msgdata->info = g_strdup("");
+	msgdata->uid = uid;
+
+	if (flags != NULL)
+		msgdata->dir = g_strdup(flags->perm_flags & MSG_NEW ? DIR_NEW : DIR_CUR);
+	else
+		msgdata->dir = g_strdup(DIR_NEW);
+
+	tmpname = get_tmppath_for_msgdata(item, msgdata);
+
+	/* link fails across file systems, copy then */
+	if ((!is_message_in_tree(item, file) || link(file, tmpname) < 0) &&
+	    copy_message_file(file, tmpname) < 0) {
+		uiddb_free_msgdata(msgdata);
+		msgdata = NULL;
+	}
+	g_free(tmpname);
+
+	return msgdata;
+}
+
+/* Moves a message from tmp/ to its place */
+static gboolean commit_delivery(MaildirFolderItem *item, MessageData *msgdata)
+{
+	gchar *tmpname, *destname;
+	gboolean ok = TRUE;
+
+	tmpname = get_tmppath_for_msgdata(item, msgdata);
+	destname = get_filepath_for_msgdata(item, msgdata);
+	if (rename(tmpname, destname) < 0) {
+		FILE_OP_ERROR(tmpname, "rename");
+		unlink(tmpname);
+		ok = FALSE;
+	}
+	g_free(destname);
+	g_free(tmpname);
+
+	return ok;
+}
+
+static MessageData *deliver_file_to_maildir(MaildirFolderItem *item, const gchar *file,
+					    MsgFlags *flags, guint32 uid)
+{
+	MessageData *msgdata;
+	GSList list;
+
+	if ((msgdata = deliver_file_to_tmp(item, file, flags, uid)) == NULL)
+		return NULL;
+
+	list.data = msgdata;
+	list.next = NULL;
+	if (get_sync_policy(item) != SYNC_NONE)
+		sync_tmp_files(item, &list);
+
+	if (!commit_delivery(item, msgdata)) {
+		uiddb_free_msgdata(msgdata);
+		return NULL;
+	}
+	if (get_sync_policy(item) != SYNC_NONE)
+		sync_dir(item, msgdata->dir);
+
+	return msgdata;
+}
+
+/* Group commit of the messages in tmp/: one sync for their data, the
+ * renames, then one sync of each directory they went to. Messages that
+ * can't be moved into place are dropped from added, with their entries
+ * in keys. */
+static void commit_batch(MaildirFolderItem *item, GSList **added, GSList **keys)
+{
+	GSList *cur, *key, *committed = NULL, *committed_keys = NULL;
+	gboolean to_new = FALSE, to_cur = FALSE;
+
+	sync_tmp_files(item, *added);
+
+	for (cur = *added, key = *keys; cur != NULL;
+	     cur = g_slist_next(cur), key = g_slist_next(key)) {
+		MessageData *msgdata = (MessageData *) cur->data;
+
+		if (!commit_delivery(item, msgdata)) {
+			uiddb_free_msgdata(msgdata);
+			continue;
+		}
+		if (!strcmp(msgdata->dir, DIR_NEW))
+			to_new = TRUE;
+		else
+			to_cur = TRUE;
+		committed = g_slist_prepend(committed, msgdata);
+		committed_keys = g_slist_prepend(committed_keys, key->data);
+	}
+	g_slist_free(*added);
+	g_slist_free(*keys);
+	*added = g_slist_reverse(committed);
+	*keys = g_slist_reverse(committed_keys);
+
+	if (to_new)
+		sync_dir(item, DIR_NEW);
+	if (to_cur)
+		sync_dir(item, DIR_CUR);
+}
+
+/* Gives the delivered messages in added (a list of MessageData) their
+ * UIDs from dovecot-uidlist right away if the folder maintains it */
+static void register_added(MaildirFolderItem *item, GSList *added)
+{
+	GSList *cur, *names = NULL;
+	gboolean valid = TRUE;
+	gchar *path;
+
+	if (added == NULL || item->uidlist == NULL ||
+	    get_uidsource(item) != UIDSOURCE_DOVECOT_WRITE)
+		return;
+
+	for (cur = added; cur != NULL; cur = g_slist_next(cur)) {
+		MessageData *msgdata = (MessageData *) cur->data;
+
+		names = g_slist_prepend(names, msgdata->info[0] ?
+					g_strconcat(msgdata->uniq, ":", msgdata->info, NULL) :
+					g_strdup(msgdata->uniq));
+	}
+	names = g_slist_reverse(names);
+
+	path = maildir_item_get_path(FOLDER_ITEM(item)->folder, FOLDER_ITEM(item));
+	if (uidlist_append(UIDLIST_DOVECOT, path, names) > 0) {
+		update_uidlist(item, path, &valid);
+		if (!valid)
+			item->renumbered = TRUE;
+	}
+	g_free(path);
+	g_slist_foreach(names, (GFunc) g_free, NULL);
+	g_slist_free(names);
+
+	for (cur = added; cur != NULL && item->uidlist != NULL; cur = g_slist_next(cur)) {
+		MessageData *msgdata = (MessageData *) cur->data;
+		guint32 uid;
+
+		uid = uidlist_get_uid(item->uidlist, msgdata->uniq);
+		if (uid != 0)
+			msgdata->uid = claim_uid(item, uid);
+	}
+}
+
+/* Deliver all files of file_list (a list of MsgFileInfo) with a single
+ * range of UIDs and a single batch of UIDDB inserts. Returns the last
+ * UID added or -1 if no file could be added. */
+static gint add_files_to_maildir(MaildirFolderItem *item, GSList *file_list,
+				 GHashTable *relation)
+{
+	GSList *cur, *key, *added = NULL, *keys = NULL;
+	guint32 uid;
+	gint lastuid = -1;
+	gboolean batch;
+
+	g_return_val_if_fail(item != NULL, -1);
+	if (file_list == NULL)
+		return -1;
+        g_return_val_if_fail(open_database(MAILDIR_FOLDERITEM(item)) == 0, -1);
+
+	uid = uiddb_reserve_uids(item->db, g_slist_length(file_list));
+	batch = get_sync_policy(item) == SYNC_BATCH;
+
+	for (cur = file_list; cur != NULL; cur = g_slist_next(cur), uid++) {
+		MsgFileInfo *fileinfo = (MsgFileInfo *) cur->data;
+		MessageData *msgdata;
+
+		if (batch)
+			msgdata = deliver_file_to_tmp(item, fileinfo->file, fileinfo->flags, uid);
+		else
+			msgdata = deliver_file_to_maildir(item, fileinfo->file, fileinfo->flags, uid);
+		if (msgdata == NULL)
+			continue;
+
+		added = g_slist_prepend(added, msgdata);
+		keys = g_slist_prepend(keys, fileinfo->msginfo != NULL ?
+				       (gpointer) fileinfo->msginfo :
+				       (gpointer) fileinfo);
+	}
+
+	added = g_slist_reverse(added);
+	keys = g_slist_reverse(keys);
+	if (batch)
+		commit_batch(item, &added, &keys);
+	register_added(item, added);
+
+	for (cur = added, key = keys; cur != NULL;
+	     cur = g_slist_next(cur), key = g_slist_next(key)) {
+		MessageData *msgdata = (MessageData *) cur->data;
+
+		lastuid = msgdata->uid;
+		if (relation != NULL)
+			g_hash_table_insert(relation, key->data,
+					    GINT_TO_POINTER(msgdata->uid));
+	}
+	g_slist_free(keys);
+
+	uiddb_insert_entries(item->db, added);
+	g_slist_foreach(added, (GFunc) uiddb_free_msgdata, NULL);
+	g_slist_free(added);
+
+	close_database(MAILDIR_FOLDERITEM(item));
+	return lastuid;
+}
+
+/* A single message goes through add_files_to_maildir() as well, so the
+ * sync policy of the folder applies to it the same way */
+static gint maildir_add_msg(Folder *folder, FolderItem *_dest, const gchar *file, MsgFlags *flags)
+{
+	MaildirFolderItem *dest = MAILDIR_FOLDERITEM(_dest);
+	MsgFileInfo fileinfo;
+	GSList file_list = { &fileinfo, NULL };
+
+	g_return_val_if_fail(folder != NULL, -1);
+	g_return_val_if_fail(dest != NULL, -1);
+	g_return_val_if_fail(file != NULL, -1);
+
+	fileinfo.msginfo = NULL;
+	fileinfo.file = (gchar *) file;
+	fileinfo.flags = flags;
+
+	return add_files_to_maildir(dest, &file_list, NULL);
+}
+
+static gint maildir_add_msgs(Folder *folder, FolderItem *_dest, GSList *file_list,
+			     GHashTable *relation)
+{
+	MaildirFolderItem *dest = MAILDIR_FOLDERITEM(_dest);
+
+	g_return_val_if_fail(folder != NULL, -1);
+	g_return_val_if_fail(dest != NULL, -1);
+	g_return_val_if_fail(file_list != NULL, -1);
+
+	return add_files_to_maildir(dest, file_list, relation);
+}
+
+/* Returns the file to copy msginfo from. Queue and draft messages get
+ * their special headers removed into a temporary file, in which case
+ * *delsrc is set and the caller has to unlink the file. */
+static gchar *get_copy_source(FolderItem *dest, MsgInfo *msginfo, gboolean *delsrc)
+{
+	gchar *srcfile;
+
+	*delsrc = FALSE;
+
+	srcfile = procmsg_get_message_file(msginfo);
+	if (srcfile == NULL)
+		return NULL;
+
+	if ((MSG_IS_QUEUED(msginfo->flags) || MSG_IS_DRAFT(msginfo->flags))
+	    && dest->stype != F_QUEUE && dest->stype != F_DRAFT) {
+		gchar *tmpfile;
+
+		tmpfile = get_tmp_file();
+		if (procmsg_remove_special_headers(srcfile, tmpfile) != 0) {
+			g_free(srcfile);
+			g_free(tmpfile);
+			return NULL;
+		}		
+		g_free(srcfile);
+		srcfile = tmpfile;
+		*delsrc = TRUE;
+	}
+
+	return srcfile;
+}
+
+/* Moves the message of msginfo from another folder of the same Maildir++
+ * tree into dest with rename() and takes its UIDDB record along. The
+ * message keeps its uniq. If syncdirs is not NULL the directories the
+ * message left and went to are added to it instead of being synced.
+ * Returns the new UID or -1 if the message has to be copied instead. */
+static gint move_msg_in_tree(MaildirFolderItem *dest, MsgInfo *msginfo,
+			     GHashTable *syncdirs)
+{
+	MaildirFolderItem *src;
+	MessageData *msgdata;
+	gchar *srcname, *destname, *srcdir;
+	gint uid = -1;
+
+	if (!MSG_IS_MOVE(msginfo->flags) || msginfo->folder == NULL ||
+	    msginfo->folder == FOLDER_ITEM(dest) ||
+	    msginfo->folder->folder != FOLDER_ITEM(dest)->folder)
+		return -1;
+	/* these get their special headers removed on the way */
+	if ((MSG_IS_QUEUED(msginfo->flags) || MSG_IS_DRAFT(msginfo->flags))
+	    && FOLDER_ITEM(dest)->stype != F_QUEUE && FOLDER_ITEM(dest)->stype != F_DRAFT)
+		return -1;
+
+	src = MAILDIR_FOLDERITEM(msginfo->folder);
+	if (open_database(src) != 0)
+		return -1;
+	if (open_database(dest) != 0) {
+		close_database(src);
+		return -1;
+	}
+
+	msgdata = get_msgdata_for_uid(src, msginfo->msgnum);
+	if (msgdata == NULL)
+		goto out;
+	srcname = get_filepath_for_msgdata(src, msgdata);
+
+	g_free(msgdata->info);
+	msgdata->info = get_infostr(msginfo->flags.perm_flags);
+	srcdir = msgdata->dir;
+	msgdata->dir = g_strdup(msginfo->flags.perm_flags & MSG_NEW ? DIR_NEW : DIR_CUR);
+	destname = get_filepath_for_msgdata(dest, msgdata);
+
+	if (rename(srcname, destname) == 0) {
+		GSList added = { msgdata, NULL };
+
+		/* the file name has no UID, a failed rename must not use one up */
+		msgdata->uid = uiddb_get_new_uid(dest->db);
+		if (syncdirs != NULL) {
+			defer_sync_dir(syncdirs, dest, msgdata->dir);
+			defer_sync_dir(syncdirs, src, srcdir);
+		} else if (get_sync_policy(dest) != SYNC_NONE) {
+			sync_dir(dest, msgdata->dir);
+			sync_dir(src, srcdir);
+		}
+		uiddb_delete_entry(src->db, msginfo->msgnum);
+		register_added(dest, &added);
+		uiddb_insert_entry(dest->db, msgdata);
+		uid = msgdata->uid;
+	} else if (errno != EXDEV)
+		FILE_OP_ERROR(srcname, "rename");
+
+	g_free(destname);
+	g_free(srcname);
+	g_free(srcdir);
+	uiddb_free_msgdata(msgdata);
+ out:
+	close_database(dest);
+	close_database(src);
+
+	return uid;
+}
+
+/* Like maildir_add_msg(), a single message shares the path of a batch */
+static gint maildir_copy_msg(Folder *folder, FolderItem *dest, MsgInfo *msginfo)
+{
+	MsgInfoList msglist = { msginfo, NULL };
+
+	g_return_val_if_fail(folder != NULL, -1);
+	g_return_val_if_fail(dest != NULL, -1);
+	g_return_val_if_fail(msginfo != NULL, -1);
+
+	return maildir_copy_msgs(folder, dest, &msglist, NULL);
+}
+
+static gint maildir_copy_msgs(Folder *folder, FolderItem *dest, MsgInfoList *msglist,
+			      GHashTable *relation)
+{
+	MsgInfoList *cur;
+	GSList *file_list = NULL, *tmpfiles = NULL, *fcur;
+	GHashTable *syncdirs = NULL;
+	gint ret, moved = -1;
+
+	g_return_val_if_fail(folder != NULL, -1);
+	g_return_val_if_fail(dest != NULL, -1);
+	g_return_val_if_fail(msglist != NULL, -1);
+
+	/* a batch of moves syncs each directory once at the end */
+	if (get_sync_policy(MAILDIR_FOLDERITEM(dest)) == SYNC_BATCH)
+		syncdirs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	for (cur = msglist; cur != NULL; cur = g_slist_next(cur)) {
+		MsgInfo *msginfo = (MsgInfo *) cur->data;
+		MsgFileInfo *fileinfo;
+		gboolean delsrc;
+		gchar *srcfile;
+		gint uid;
+
+		/* moves within the tree need no copy and no removal */
+		if ((uid = move_msg_in_tree(MAILDIR_FOLDERITEM(dest), msginfo, syncdirs)) > 0) {
+			MSG_SET_TMP_FLAGS(msginfo->flags, MSG_MOVE_DONE);
+			if (relation != NULL)
+				g_hash_table_insert(relation, msginfo, GINT_TO_POINTER(uid));
+			moved = MAX(moved, uid);
+			continue;
+		}
+
+		srcfile = get_copy_source(dest, msginfo, &delsrc);
+		if (srcfile == NULL)
+			continue;
+		if (delsrc)
+			tmpfiles = g_slist_prepend(tmpfiles, srcfile);
+
+		fileinfo = g_new0(MsgFileInfo, 1);
+		fileinfo->msginfo = msginfo;
+		fileinfo->file = srcfile;
+		fileinfo->flags = &msginfo->flags;
+		file_list = g_slist_prepend(file_list, fileinfo);
+	}
+	file_list = g_slist_reverse(file_list);
+
+	if (syncdirs != NULL) {
+		sync_dirs(syncdirs);
+		g_hash_table_destroy(syncdirs);
+	}
+
+	ret = add_files_to_maildir(MAILDIR_FOLDERITEM(dest), file_list, relation);
+	ret = MAX(ret, moved);
+
+	for (fcur = tmpfiles; fcur != NULL; fcur = g_slist_next(fcur))
+		unlink((gchar *) fcur->data);
+	g_slist_free(tmpfiles);
+
+	for (fcur = file_list; fcur != NULL; fcur = g_slist_next(fcur)) {
+		MsgFileInfo *fileinfo = (MsgFileInfo *) fcur->data;
+
+		g_free(fileinfo->file);
+		g_free(fileinfo);
+	}
+	g_slist_free(file_list);
+
+	return ret;
+}
+
+static gint remove_msg_for_uid(MaildirFolderItem *item, guint32 uid)
+{
+	gchar *filename;
+	gint ret;
+
+	filename = get_filepath_for_uid(item, uid);
+	if (filename == NULL)
+		return -1;
+
+	ret = unlink(filename);	
+	if (ret == 0)
+		uiddb_delete_entry(item->db, uid);
+
+	g_free(filename);
+
+	return ret;
+}
+
+static gint maildir_remove_msg(Folder *folder, FolderItem *_item, gint num)
+{
+	MaildirFolderItem *item = MAILDIR_FOLDERITEM(_item);
+	gint ret;
+
+	g_return_val_if_fail(folder != NULL, -1);
+	g_return_val_if_fail(item != NULL, -1);
+	g_return_val_if_fail(num > 0, -1);
+
+        g_return_val_if_fail(open_database(MAILDIR_FOLDERITEM(item)) == 0, -1);
+	
+	ret = remove_msg_for_uid(item, num);
+
+	close_database(MAILDIR_FOLDERITEM(item));
+	return ret;
 }
 
-static MsgInfo *maildir_get_msginfo(Folder * folder,
-				    FolderItem * item, gint num)
+struct RemoveData
 {
-	MsgInfo *msginfo;
-	gchar *file;
+	gint	 curfd;
+	gint	 newfd;
+	GSList	*missing;
+};
 
-	g_return_val_if_fail(item != NULL, NULL);
-	g_return_val_if_fail(num > 0, NULL);
+static gboolean remove_file_func(MessageData *msgdata, gpointer data)
+{
+	struct RemoveData *removedata = data;
+	gchar *msgname;
+	gint dirfd = -1;
 
-	file = maildir_fetch_msg(folder, item, num);
-	if (!file) return NULL;
+	if (!strcmp(msgdata->dir, DIR_CUR))
+		dirfd = removedata->curfd;
+	else if (!strcmp(msgdata->dir, DIR_NEW))
+		dirfd = removedata->newfd;
 
-	msginfo = maildir_parse_msg(file, item);
-	if (msginfo)
-		msginfo->msgnum = num;
+	if (msgdata->info[0])
+		msgname = g_strconcat(msgdata->uniq, ":", msgdata->info, NULL);
+	else
+		msgname = g_strdup(msgdata->uniq);
 
-	g_free(file);
+	if (dirfd >= 0 && unlinkat(dirfd, msgname, 0) == 0) {
+		g_free(msgname);
+		return TRUE;
+	}
 
-	return msginfo;
-}
+	/* renamed by another program, search for it later */
+	if (dirfd < 0 || errno == ENOENT)
+		removedata->missing = g_slist_prepend(removedata->missing,
+						      GINT_TO_POINTER(msgdata->uid));
+	else
+		FILE_OP_ERROR(msgname, "unlinkat");
+	g_free(msgname);
 
-static gchar *maildir_fetch_msg(Folder * folder, FolderItem * item,
-				gint num)
-{
-	gchar *filename;
-	
-        g_return_val_if_fail(open_database(MAILDIR_FOLDERITEM(item)) == 0, NULL);
-	filename = get_filepath_for_uid((MaildirFolderItem *) item, num);
-	close_database(MAILDIR_FOLDERITEM(item));
-	
-	return filename;
+	return FALSE;
 }
 
-static gchar *generate_uniq()
+static gint maildir_remove_msgs(Folder *folder, FolderItem *_item,
+				MsgInfoList *msglist, GHashTable *relation)
 {
-	gchar hostname[32], *strptr;
-	static gint q = 1;
-	struct timeval tv;
+	MaildirFolderItem *item = MAILDIR_FOLDERITEM(_item);
+	struct RemoveData removedata;
+	MsgNumberList *numlist = NULL;
+	MsgInfoList *cur;
+	GSList *missing;
+	gchar *path;
 
-	gethostname(hostname, 32);
-	hostname[31] = '\0';
+	g_return_val_if_fail(folder != NULL, -1);
+	g_return_val_if_fail(item != NULL, -1);
+	g_return_val_if_fail(msglist != NULL, -1);
 
-	strptr = &hostname[0];
-	while (*strptr != '\0') {
-		if (*strptr == '/')
-			*strptr = '\057';
-		if (*strptr == ':')
-			*strptr = '\072';
-		strptr++;
+        g_return_val_if_fail(open_database(MAILDIR_FOLDERITEM(item)) == 0, -1);
+
+	for (cur = msglist; cur != NULL; cur = g_slist_next(cur)) {
+		MsgInfo *msginfo = (MsgInfo *) cur->data;
+
+		numlist = g_slist_prepend(numlist, GINT_TO_POINTER(msginfo->msgnum));
 	}
+	numlist = g_slist_reverse(numlist);
 
-	gettimeofday(&tv, NULL);
+	path = maildir_item_get_path(folder, _item);
+	removedata.curfd = open_subdir(path, DIR_CUR);
+	removedata.newfd = open_subdir(path, DIR_NEW);
+	removedata.missing = NULL;
+	g_free(path);
 
-	return g_strdup_printf("%d.P%dQ%dM%d.%s", (int) tv.tv_sec, getpid(), q++, (int) tv.tv_usec, hostname);
+	uiddb_delete_entries_in_list(item->db, numlist, remove_file_func, &removedata);
+
+	if (removedata.curfd >= 0)
+		close(removedata.curfd);
+	if (removedata.newfd >= 0)
+		close(removedata.newfd);
+
+	for (missing = removedata.missing; missing != NULL; missing = g_slist_next(missing))
+		remove_msg_for_uid(item, GPOINTER_TO_INT(missing->data));
+	g_slist_free(removedata.missing);
+	g_slist_free(numlist);
+
+	close_database(MAILDIR_FOLDERITEM(item));
+	return 0;
 }
 
-static gchar *get_infostr(MsgPermFlags permflags)
+static void remove_subdir_files(const gchar *path, const gchar *subdir)
 {
-	if (permflags & MSG_NEW)
-		return g_strdup("");
+	DIR *dp;
+	struct dirent *d;
+	gint fd;
 
-	return g_strconcat("2,",
-		  permflags & MSG_MARKED    ? "F" : "",
-		  permflags & MSG_FORWARDED ? "P" : "",
-		  permflags & MSG_REPLIED   ? "R" : "",
-		!(permflags & MSG_UNREAD)   ? "S" : "",
-		NULL);
+	fd = open_subdir(path, subdir);
+	if (fd < 0)
+		return;
+
+	if ((dp = fdopendir(fd)) == NULL) {
+		close(fd);
+		return;
+	}
+
+	while ((d = readdir(dp)) != NULL) {
+		if (d->d_name[0] == '.')
+			continue;
+		if (unlinkat(fd, d->d_name, 0) < 0 && errno != ENOENT)
+			FILE_OP_ERROR(d->d_name, "unlinkat");
+	}
+
+	closedir(dp);
 }
 
-static gint add_file_to_maildir(MaildirFolderItem *item, const gchar *file, MsgFlags *flags)
+static gint maildir_remove_all_msg(Folder *folder, FolderItem *_item)
 {
-	MessageData *msgdata;
-	gchar *tmpname, *destname;
-	gint uid = -1;
+	MaildirFolderItem *item = MAILDIR_FOLDERITEM(_item);
+	gchar *path;
 
+	g_return_val_if_fail(folder != NULL, -1);
 	g_return_val_if_fail(item != NULL, -1);
+
         g_return_val_if_fail(open_database(MAILDIR_FOLDERITEM(item)) == 0, -1);
 
-	msgdata = g_new0(MessageData, 1);
-	msgdata->uniq = generate_uniq();
-	if (flags != NULL)
-		msgdata->info = get_infostr(flags->perm_flags);
-	else
-		msgdata->info = g_strdup("");
-	msgdata->uid = uiddb_get_new_uid(item->db);
+	path = maildir_item_get_path(folder, _item);
+	remove_subdir_files(path, DIR_CUR);
+	remove_subdir_files(path, DIR_NEW);
+	g_free(path);
 
-	msgdata->dir = DIR_TMP;
-	tmpname = get_filepath_for_msgdata(item, msgdata);
+	uiddb_delete_all_entries(item->db);
 
-	if (flags != NULL)
-		msgdata->dir = g_strdup(flags->perm_flags & MSG_NEW ? DIR_NEW : DIR_CUR);
-	else
-		msgdata->dir = g_strdup(DIR_NEW);
+	close_database(MAILDIR_FOLDERITEM(item));
+	return 0;
+}
 
-	if (copy_file(file, tmpname, FALSE) < 0) {
-		goto exit;
-	}
+/* Sets info and dir of msgdata for newflags, returns TRUE if the file
+ * has to be renamed */
+static gboolean set_msgdata_flags(MessageData *msgdata, MsgPermFlags newflags)
+{
+	gchar *newinfo, *newdir;
+	gboolean renamefile = FALSE;
 
-	destname = get_filepath_for_msgdata(item, msgdata);
-	if (rename(tmpname, destname) < 0) {
-		g_free(destname);
-		goto exit;
-	}
+	newinfo = get_infostr(newflags);
+	if (strcmp(msgdata->info, newinfo)) {
+		g_free(msgdata->info);
+		msgdata->info = newinfo;
+		renamefile = TRUE;
+	} else
+		g_free(newinfo);
 
-	uiddb_insert_entry(item->db, msgdata);
+	newdir = g_strdup(newflags & MSG_NEW ? DIR_NEW : DIR_CUR);
+	if (strcmp(msgdata->dir, newdir)) {
+		g_free(msgdata->dir);
+		msgdata->dir = newdir;
+		renamefile = TRUE;
+	} else
+		g_free(newdir);
 
-	uid = msgdata->uid;
-	
- exit:
-	uiddb_free_msgdata(msgdata);
-	g_free(tmpname);
-	close_database(MAILDIR_FOLDERITEM(item));
-	return uid;
+	return renamefile;
 }
 
-static gint maildir_add_msg(Folder *folder, FolderItem *_dest, const gchar *file, MsgFlags *flags)
+/* Keeps the flags of the last scan in step with a renamed message */
+static void update_scan_flags(MaildirFolderItem *item, MessageData *msgdata)
 {
-	MaildirFolderItem *dest = MAILDIR_FOLDERITEM(_dest);
+	if (item->scan_flags != NULL &&
+	    item->flags_generation == item->scan_generation)
+		set_scan_flags(item, msgdata->uid, msgdata->info);
+}
 
-	g_return_val_if_fail(folder != NULL, -1);
-	g_return_val_if_fail(dest != NULL, -1);
-	g_return_val_if_fail(file != NULL, -1);
+/* The file name of the displayed message changed, show it again */
+static void update_message_view(GSList *msginfos)
+{
+	MainWindow *mainwin = mainwindow_get_mainwindow();
+	SummaryView *summaryview = mainwin->summaryview;
+	MsgInfo *msginfo;
+	gint displayed_msgnum;
+
+	if (!summaryview->displayed)
+		return;
+	displayed_msgnum = summary_get_msgnum(summaryview, summaryview->displayed);
 
-	return add_file_to_maildir(dest, file, flags);
+	for (; msginfos != NULL; msginfos = msginfos->next) {
+		msginfo = msginfos->data;
+		if (displayed_msgnum == msginfo->msgnum
+		&& summaryview->folder_item == msginfo->folder) {
+			messageview_show(
+				summaryview->messageview, 
+				msginfo,
+				summaryview->messageview->all_headers);
+			break;
+		}
+	}
 }
 
-static gint maildir_copy_msg(Folder *folder, FolderItem *dest, MsgInfo *msginfo)
+typedef struct _FlagChange FlagChange;
+
+struct _FlagChange
 {
-	gchar *srcfile;
-	gint ret = -1;
-	gboolean delsrc = FALSE;
+	MsgInfo		*msginfo;
+	MsgPermFlags	 oldflags;
+	MsgPermFlags	 newflags;
 
-	g_return_val_if_fail(folder != NULL, -1);
-	g_return_val_if_fail(dest != NULL, -1);
-	g_return_val_if_fail(msginfo != NULL, -1);
+	/* filled in when the change is applied */
+	MessageData	*msgdata;
+	gchar		*olddir;
+	gchar		*oldname;
+	gchar		*newname;
+};
 
-	srcfile = procmsg_get_message_file(msginfo);
-	if (srcfile == NULL)
-		return -1;
+static void free_flag_change(FlagChange *change)
+{
+	procmsg_msginfo_free(&change->msginfo);
+	if (change->msgdata != NULL)
+		uiddb_free_msgdata(change->msgdata);
+	g_free(change->olddir);
+	g_free(change->oldname);
+	g_free(change->newname);
+	g_free(change);
+}
 
-	if ((MSG_IS_QUEUED(msginfo->flags) || MSG_IS_DRAFT(msginfo->flags))
-	    && dest->stype != F_QUEUE && dest->stype != F_DRAFT) {
-		gchar *tmpfile;
+/* Groups the renames by source and target directory */
+static gint flag_change_compare(gconstpointer a, gconstpointer b)
+{
+	const FlagChange *ca = a, *cb = b;
+	gint ret;
 
-		tmpfile = get_tmp_file();
-		if (procmsg_remove_special_headers(srcfile, tmpfile) != 0) {
-			g_free(srcfile);
-			g_free(tmpfile);
-			return -1;
-		}		
-		g_free(srcfile);
-		srcfile = tmpfile;
-		delsrc = TRUE;
+	if ((ret = strcmp(ca->olddir, cb->olddir)) != 0)
+		return ret;
+	if ((ret = strcmp(ca->msgdata->dir, cb->msgdata->dir)) != 0)
+		return ret;
+	return ca->msgdata->uid < cb->msgdata->uid ? -1 :
+	       ca->msgdata->uid > cb->msgdata->uid;
+}
+
+/* Applies the flag changes collected during a batch: the files are
+ * renamed one directory at a time, the UIDDB records are replaced
+ * together and the message view is updated once */
+static void flush_flag_changes(MaildirFolderItem *item)
+{
+	GList *changes, *cur;
+	GSList *renames = NULL, *renamed = NULL, *updated = NULL, *elem;
+	FlagChange *change;
+
+	if (item->flag_changes == NULL ||
+	    g_hash_table_size(item->flag_changes) == 0)
+		return;
+
+	changes = g_hash_table_get_values(item->flag_changes);
+	g_hash_table_steal_all(item->flag_changes);
+
+	if (open_database(item) != 0) {
+		for (cur = changes; cur != NULL; cur = cur->next) {
+			change = cur->data;
+			change->msginfo->flags.perm_flags = change->oldflags;
+			free_flag_change(change);
+		}
+		g_list_free(changes);
+		return;
+	}
+
+	for (cur = changes; cur != NULL; cur = cur->next) {
+		change = cur->data;
+		change->msgdata = uiddb_get_entry_for_uid(item->db, change->msginfo->msgnum);
+		if (change->msgdata == NULL) {
+			change->msginfo->flags.perm_flags = change->oldflags;
+			continue;
+		}
+		change->olddir = g_strdup(change->msgdata->dir);
+		change->oldname = get_filepath_for_msgdata(item, change->msgdata);
+		if (!set_msgdata_flags(change->msgdata, change->newflags))
+			continue;
+		change->newname = get_filepath_for_msgdata(item, change->msgdata);
+		renames = g_slist_prepend(renames, change);
 	}
 
-	ret = add_file_to_maildir(MAILDIR_FOLDERITEM(dest), srcfile, &msginfo->flags);
+	renames = g_slist_sort(renames, flag_change_compare);
+	for (elem = renames; elem != NULL; elem = elem->next) {
+		change = elem->data;
+		if (rename(change->oldname, change->newname) == 0) {
+			uiddb_delete_entry(item->db, change->msgdata->uid);
+			update_scan_flags(item, change->msgdata);
+			updated = g_slist_prepend(updated, change->msgdata);
+			renamed = g_slist_prepend(renamed, change->msginfo);
+		} else {
+			FILE_OP_ERROR(change->oldname, "rename");
+			change->msginfo->flags.perm_flags = change->oldflags;
+		}
+	}
+	uiddb_insert_entries(item->db, updated);
 
-	if (delsrc)
-		unlink(srcfile);
-	g_free(srcfile);
+	close_database(item);
 
-	return ret;
+	if (renamed != NULL)
+		update_message_view(renamed);
+
+	g_slist_free(renamed);
+	g_slist_free(updated);
+	g_slist_free(renames);
+	for (cur = changes; cur != NULL; cur = cur->next)
+		free_flag_change(cur->data);
+	g_list_free(changes);
 }
 
-static gint maildir_remove_msg(Folder *folder, FolderItem *_item, gint num)
+static void maildir_set_batch(Folder *folder, FolderItem *_item, gboolean batch)
 {
 	MaildirFolderItem *item = MAILDIR_FOLDERITEM(_item);
-	gchar *filename;
-	gint ret;
-
-	g_return_val_if_fail(folder != NULL, -1);
-	g_return_val_if_fail(item != NULL, -1);
-	g_return_val_if_fail(num > 0, -1);
 
-        g_return_val_if_fail(open_database(MAILDIR_FOLDERITEM(item)) == 0, -1);
-	
-	filename = get_filepath_for_uid(item, num);
-	if (filename == NULL) {
-		ret = -1;
-		goto close;
-	}
+	if (item->batch == batch)
+		return;
 
-	ret = unlink(filename);	
-	if (ret == 0)
-		uiddb_delete_entry(item->db, num);
+	item->batch = batch;
+	if (!batch)
+		flush_flag_changes(item);
+}
 
-	g_free(filename);
-	
- close:
-	close_database(MAILDIR_FOLDERITEM(item));
-	return ret;
+/* Records a flag change for the end of the batch. The flags of msginfo
+ * change at once, the file is renamed later. */
+static void queue_flag_change(MaildirFolderItem *item, MsgInfo *msginfo,
+			      MsgPermFlags newflags)
+{
+	FlagChange *change;
+
+	if (item->flag_changes == NULL)
+		item->flag_changes = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	change = g_hash_table_lookup(item->flag_changes, GUINT_TO_POINTER(msginfo->msgnum));
+	if (change == NULL) {
+		change = g_new0(FlagChange, 1);
+		change->msginfo = procmsg_msginfo_new_ref(msginfo);
+		change->oldflags = msginfo->flags.perm_flags;
+		g_hash_table_insert(item->flag_changes,
+				    GUINT_TO_POINTER(msginfo->msgnum), change);
+	}
+	change->newflags = newflags;
+	msginfo->flags.perm_flags = newflags;
 }
 
 static void maildir_change_flags(Folder *folder, FolderItem *_item, MsgInfo *msginfo, MsgPermFlags newflags)
 {
 	MaildirFolderItem *item = MAILDIR_FOLDERITEM(_item);
 	MessageData *msgdata;
-	gchar *oldname, *newinfo, *newdir;
+	gchar *oldname;
 	gboolean renamefile = FALSE;
 
+	if (item->batch) {
+		queue_flag_change(item, msginfo, newflags);
+		return;
+	}
+
 	g_return_if_fail(open_database(MAILDIR_FOLDERITEM(item)) == 0);
 
 	msgdata = get_msgdata_for_uid(item, msginfo->msgnum);
@@ -890,22 +3247,7 @@ static void maildir_change_flags(Folder *folder, FolderItem *_item, MsgInfo *msg
 	
 	oldname = get_filepath_for_msgdata(item, msgdata);
 
-	newinfo = get_infostr(newflags);
-	if (strcmp(msgdata->info, newinfo)) {
-		g_free(msgdata->info);
-		msgdata->info = newinfo;
-		renamefile = TRUE;
-	} else
-		g_free(newinfo);
-
-	newdir = g_strdup(newflags & MSG_NEW ? DIR_NEW : DIR_CUR);
-	if (strcmp(msgdata->dir, newdir)) {
-		g_free(msgdata->dir);
-		msgdata->dir = newdir;
-		renamefile = TRUE;
-	} else
-		g_free(newdir);
-
+	renamefile = set_msgdata_flags(msgdata, newflags);
 	if (renamefile) {
 		gchar *newname;
 
@@ -914,6 +3256,7 @@ static void maildir_change_flags(Folder *folder, FolderItem *_item, MsgInfo *msg
 			uiddb_delete_entry(item->db, msgdata->uid);
 			uiddb_insert_entry(item->db, msgdata);
 			msginfo->flags.perm_flags = newflags;
+			update_scan_flags(item, msgdata);
 		}
 		g_free(newname);
 	} else {
@@ -926,18 +3269,9 @@ static void maildir_change_flags(Folder *folder, FolderItem *_item, MsgInfo *msg
 	close_database(MAILDIR_FOLDERITEM(item));
 	
 	if (renamefile) {
-		MainWindow *mainwin = mainwindow_get_mainwindow();
-		SummaryView *summaryview = mainwin->summaryview;
-		gint displayed_msgnum = -1;
-		if (summaryview->displayed)
-			displayed_msgnum = summary_get_msgnum(summaryview,
-						      summaryview->displayed);
-		if (displayed_msgnum == msginfo->msgnum
-		&& summaryview->folder_item == msginfo->folder)
-			messageview_show(
-				summaryview->messageview, 
-				msginfo,
-				summaryview->messageview->all_headers);
+		GSList single = { msginfo, NULL };
+
+		update_message_view(&single);
 	}
 	
 	return;
@@ -1159,6 +3493,12 @@ static gboolean remove_folder_func(GNode *node, gpointer data)
 	if (item->stype != F_NORMAL)
 		return FALSE;
 
+	unwatch_item(MAILDIR_FOLDERITEM(item));
+	if (MAILDIR_FOLDERITEM(item)->db != NULL) {
+		MAILDIR_FOLDERITEM(item)->db_users = 0;
+		release_database(MAILDIR_FOLDERITEM(item));
+	}
+
 	path = folder_item_get_path(item);
 	debug_print("removing directory %s\n", path);
 	if (remove_dir_recursive(path) < 0) {
@@ -1184,9 +3524,11 @@ static gint maildir_remove_folder(Folder *folder, FolderItem *item)
 	g_return_val_if_fail(item->stype == F_NORMAL, -1);
 
 	debug_print("removing folder %s\n", item->path);
+	load_subtree(item);
 
 	g_node_traverse(item->node, G_POST_ORDER, G_TRAVERSE_ALL, -1,
 			remove_folder_func, &res);
+	forget_folder_names(folder);
 
 	return res;
 }
@@ -1214,6 +3556,11 @@ static gboolean rename_folder_func(GNode *node, gpointer data)
 	if (item->stype != F_NORMAL)
 		return FALSE;
 
+	if (MAILDIR_FOLDERITEM(item)->db != NULL) {
+		MAILDIR_FOLDERITEM(item)->db_users = 0;
+		release_database(MAILDIR_FOLDERITEM(item));
+	}
+
 	real_rootpath = filename_from_utf8(LOCAL_FOLDER(item->folder)->rootpath);
 	real_path = filename_from_utf8(item->path);
 	suffix = real_path + renamedata->oldprefixlen;
@@ -1252,6 +3599,7 @@ static gint maildir_rename_folder(Folder *folder, FolderItem *item,
 	g_return_val_if_fail(name != NULL, -1);
 
 	debug_print("renaming folder %s to %s\n", item->path, name);
+	load_subtree(item);
 
 	g_free(item->name);
 	item->name = g_strdup(name);
@@ -1274,72 +3622,102 @@ static gint maildir_rename_folder(Folder *folder, FolderItem *item,
 			rename_folder_func, &renamedata);
 
 	g_free(renamedata.newprefix);
+	forget_folder_names(folder);
 
 	return 0;
 }
 
-static gint get_flags_for_msgdata(MessageData *msgdata, MsgPermFlags *flags)
+static gint get_flags_for_view(const MessageDataView *view, MsgPermFlags *flags)
 {
-	gint	i;
+	if (!(view->flags & MAILDIR_INFO_V2))
+		return -1;
 
-	g_return_val_if_fail(msgdata != NULL, -1);
-	g_return_val_if_fail(msgdata->info != NULL, -1);
+	*flags = info_perm_flags[(view->flags >> 1) & 0xf];
 
-	if ((msgdata->info[0] != '2') && (msgdata->info[1] != ','))
-		return -1;
+	return 0;
+}
 
-	*flags = MSG_UNREAD;
-	for (i = 2; i < strlen(msgdata->info); i++) {
-		switch (msgdata->info[i]) {
-			case 'F':
-				  *flags |= MSG_MARKED;
-				  break;
-			case 'P':
-				  *flags |= MSG_FORWARDED;
-				  break;
-			case 'R':
-				  *flags |= MSG_REPLIED;
-				  break;
-			case 'S':
-				  *flags &= ~MSG_UNREAD;
-				  break;
-		}
+/* The flags the file name describes, the others are kept */
+#define INFO_FLAGS_MASK	(MSG_MARKED | MSG_FORWARDED | MSG_REPLIED | MSG_UNREAD)
+
+static void set_msgflags(GHashTable *msgflags, MsgInfo *msginfo, MsgPermFlags flags)
+{
+	flags |= msginfo->flags.perm_flags &
+		~(INFO_FLAGS_MASK | ((flags & MSG_UNREAD) == 0 ? MSG_NEW : 0));
+	g_hash_table_insert(msgflags, msginfo, GINT_TO_POINTER(flags));
+}
+
+/* Answers from the flags of the last scan if nothing changed since,
+ * returns the messages they don't cover */
+static MsgInfoList *get_scan_flags(MaildirFolderItem *item, MsgInfoList *msglist,
+				   GHashTable *msgflags)
+{
+	MsgInfoList *elem, *missing = NULL;
+	MsgInfo *msginfo;
+	gpointer value;
+
+	for (elem = msglist; elem != NULL; elem = g_slist_next(elem)) {
+		msginfo = (MsgInfo*) elem->data;
+		if (!g_hash_table_lookup_extended(item->scan_flags,
+						  GUINT_TO_POINTER(msginfo->msgnum),
+						  NULL, &value))
+			missing = g_slist_prepend(missing, msginfo);
+		else if (GPOINTER_TO_UINT(value) != SCAN_FLAGS_NONE)
+			set_msgflags(msgflags, msginfo, GPOINTER_TO_UINT(value));
 	}
 
-	return 0;
+	return g_slist_reverse(missing);
 }
 
 static gint maildir_get_flags (Folder *folder,  FolderItem *item,
 			       MsgInfoList *msglist, GHashTable *msgflags)
 {
-	MsgInfoList	*elem;
+	MaildirFolderItem *mitem = MAILDIR_FOLDERITEM(item);
+	MsgInfoList	*elem, *missing = NULL;
 	MsgInfo		*msginfo;
-	MessageData	*msgdata;
+	MessageDataView	view;
 	MsgPermFlags	flags;
+	UIDDB		*db;
 
 	g_return_val_if_fail(folder != NULL, -1);
 	g_return_val_if_fail(item != NULL, -1);
 	g_return_val_if_fail(msglist != NULL, -1);
 	g_return_val_if_fail(msgflags != NULL, -1);
-	g_return_val_if_fail(open_database(MAILDIR_FOLDERITEM(item)) == 0, -1);
 
+	/* the UIDDB has the flags only after pending changes are applied */
+	flush_flag_changes(mitem);
+
+	/* files the watcher saw change have their flags only after the
+	 * changes are applied */
+	if (mitem->scan_flags != NULL && !has_watch_changes(mitem) &&
+	    mitem->flags_generation == mitem->scan_generation) {
+		if ((missing = get_scan_flags(mitem, msglist, msgflags)) == NULL)
+			return 0;
+		msglist = missing;
+	}
+
+	if (open_database(mitem) != 0) {
+		g_slist_free(missing);
+		return -1;
+	}
+	db = mitem->db;
+
+	/* The records are indexed by UID in memory, so every lookup is a
+	 * single array access. Messages without a record or with info the
+	 * flags can't be taken from keep their flags. */
 	for (elem = msglist; elem != NULL; elem = g_slist_next(elem)) {
 		msginfo = (MsgInfo*) elem->data;
-		msgdata = uiddb_get_entry_for_uid(MAILDIR_FOLDERITEM(item)->db, msginfo->msgnum);
-		if (msgdata == NULL)
-			break;
+		if (!uiddb_view_entry_for_uid(db, msginfo->msgnum, &view))
+			continue;
 
-		if (get_flags_for_msgdata(msgdata, &flags) < 0)
-			break;
-
-		flags = flags | (msginfo->flags.perm_flags & 
-			~(MSG_MARKED | MSG_FORWARDED | MSG_REPLIED | MSG_UNREAD | ((flags & MSG_UNREAD) == 0 ? MSG_NEW : 0)));
-		g_hash_table_insert(msgflags, msginfo, GINT_TO_POINTER(flags));
+		if (get_flags_for_view(&view, &flags) < 0)
+			continue;
 
-		uiddb_free_msgdata(msgdata);
+		set_msgflags(msgflags, msginfo, flags);
 	}
 
-	close_database(MAILDIR_FOLDERITEM(item));
+	close_database(mitem);
+	g_slist_free(missing);
 	return 0;
 }
 
@@ -29,5 +29,8 @@
 #define DIR_PERMISSION  0700 /* Permission of maildir root directory */
 
 FolderClass *maildir_get_class();
+void maildir_close_all_databases(void);
+void maildir_watch_done(void);
+void maildir_item_expanded(FolderItem *item);
 
 #endif /* MAILDIR_H */
@@ -83,12 +83,42 @@ static GtkActionEntry mainwindow_add_mailbox[] = {{
 }};
 
 static guint main_menu_id = 0;
+static gulong tree_expand_id = 0;
+
+/* The folder tree can't change inside its own signal handler */
+static gboolean load_subfolders_idle(gpointer data)
+{
+	gchar *identifier = (gchar *) data;
+	FolderItem *item;
+
+	item = folder_find_item_from_identifier(identifier);
+	if (item != NULL)
+		maildir_item_expanded(item);
+	g_free(identifier);
+
+	return FALSE;
+}
+
+/* Mailboxes in lazy mode load deeper folders when they are shown */
+static void tree_expand_cb(GtkCMCTree *ctree, GtkCMCTreeNode *node, gpointer data)
+{
+	FolderItem *item = gtk_cmctree_node_get_row_data(ctree, node);
+
+	if (item == NULL || item->folder == NULL ||
+	    item->folder->klass != maildir_get_class())
+		return;
+
+	g_idle_add(load_subfolders_idle, folder_item_get_identifier(item));
+}
 
 void maildir_gtk_init(void)
 {
 	MainWindow *mainwin = mainwindow_get_mainwindow();
 
 	folderview_register_popup(&maildir_popup);
+	tree_expand_id = g_signal_connect_after(G_OBJECT(mainwin->folderview->ctree),
+						"tree_expand",
+						G_CALLBACK(tree_expand_cb), NULL);
 
 	gtk_action_group_add_actions(mainwin->action_group, mainwindow_add_mailbox,
 			1, (gpointer)mainwin);
@@ -105,6 +135,11 @@ void maildir_gtk_done(void)
 		return;
 
 	folderview_unregister_popup(&maildir_popup);
+	if (tree_expand_id != 0) {
+		g_signal_handler_disconnect(G_OBJECT(mainwin->folderview->ctree),
+					    tree_expand_id);
+		tree_expand_id = 0;
+	}
 
 	MENUITEM_REMUI_MANAGER(mainwin->ui_manager,mainwin->action_group, "File/AddMailbox/Maildir", main_menu_id);
 	main_menu_id = 0;
@@ -48,8 +48,10 @@ gint plugin_init(gchar **error)
 gboolean plugin_done(void)
 {
 	maildir_gtk_done();
+	maildir_watch_done();
 	if (!claws_is_exiting())
 		folder_unregister_class(maildir_get_class());
+	maildir_close_all_databases();
 	uiddb_done();
 	return TRUE;
 }
@@ -0,0 +1,476 @@
+/*
+ * Maildir Plugin -- Maildir++ support for Sylpheed
+ * Copyright (C) 2003-2004 Christoph Hohmann
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+
+#include "pluginconfig.h"
+
+#include <glib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "procmsg.h"
+#include "summarycache.h"
+
+/*
+ * The summary cache keeps the header fields of the messages of a folder
+ * so that they don't have to be parsed again in the next session. The
+ * entries are keyed by uniq, so they survive flag changes, and are only
+ * used while size and mtime of the message file are unchanged.
+ *
+ * File layout: "MDSC", guint32 version, then the records:
+ *   guint32 record size, gint64 size, gint64 mtime, gint64 date_t,
+ *   gint64 thread_date, guint32 perm_flags, guint32 tmp_flags,
+ *   guint32 mask of the strings present, uniq + NUL,
+ *   the present strings of FIELD_* + NUL each
+ *
+ * The file is mapped while the cache is open. New entries are kept in
+ * memory until the cache is saved, which writes a new file.
+ */
+
+#define CACHE_MAGIC		"MDSC"
+#define CACHE_VERSION		1
+#define CACHE_HEADER_SIZE	8
+#define RECORD_HEADER_SIZE	(4 + 4 * 8 + 3 * 4)
+
+enum
+{
+	FIELD_FROMNAME,
+	FIELD_DATE,
+	FIELD_FROM,
+	FIELD_TO,
+	FIELD_CC,
+	FIELD_NEWSGROUPS,
+	FIELD_SUBJECT,
+	FIELD_MSGID,
+	FIELD_INREPLYTO,
+	FIELD_XREF,
+	FIELD_REFERENCES,	/* joined by newlines */
+	FIELD_AVATARS,		/* "<id> <src>" lines */
+	/* extradata from here on */
+	FIELD_DISPOSITIONNOTIFICATIONTO,
+	FIELD_RETURNRECEIPTTO,
+	FIELD_PARTIAL_RECV,
+	FIELD_ACCOUNT_SERVER,
+	FIELD_ACCOUNT_LOGIN,
+	FIELD_LIST_POST,
+	FIELD_LIST_SUBSCRIBE,
+	FIELD_LIST_UNSUBSCRIBE,
+	FIELD_LIST_HELP,
+	FIELD_LIST_ARCHIVE,
+	FIELD_LIST_OWNER,
+	FIELD_RESENT_FROM,
+	FIELD_COUNT
+};
+
+#define FIELD_EXTRADATA		FIELD_DISPOSITIONNOTIFICATIONTO
+
+struct _SummaryCache
+{
+	gchar		*file;
+
+	/* the file as it was opened */
+	guchar		*map;
+	gsize		 maplen;
+	GHashTable	*mapped;	/* uniq -> record in map */
+
+	GHashTable	*added;		/* uniq -> GByteArray with the record */
+	gboolean	 dirty;
+};
+
+/* Sets slots to the places of the plain string fields of msginfo,
+ * references and avatars have none */
+static void get_slots(MsgInfo *msginfo, gchar **slots[FIELD_COUNT])
+{
+	MsgInfoExtraData *extra = msginfo->extradata;
+
+	memset(slots, 0, sizeof(gchar **) * FIELD_COUNT);
+	slots[FIELD_FROMNAME] = &msginfo->fromname;
+	slots[FIELD_DATE] = &msginfo->date;
+	slots[FIELD_FROM] = &msginfo->from;
+	slots[FIELD_TO] = &msginfo->to;
+	slots[FIELD_CC] = &msginfo->cc;
+	slots[FIELD_NEWSGROUPS] = &msginfo->newsgroups;
+	slots[FIELD_SUBJECT] = &msginfo->subject;
+	slots[FIELD_MSGID] = &msginfo->msgid;
+	slots[FIELD_INREPLYTO] = &msginfo->inreplyto;
+	slots[FIELD_XREF] = &msginfo->xref;
+	if (extra == NULL)
+		return;
+	slots[FIELD_DISPOSITIONNOTIFICATIONTO] = &extra->dispositionnotificationto;
+	slots[FIELD_RETURNRECEIPTTO] = &extra->returnreceiptto;
+	slots[FIELD_PARTIAL_RECV] = &extra->partial_recv;
+	slots[FIELD_ACCOUNT_SERVER] = &extra->account_server;
+	slots[FIELD_ACCOUNT_LOGIN] = &extra->account_login;
+	slots[FIELD_LIST_POST] = &extra->list_post;
+	slots[FIELD_LIST_SUBSCRIBE] = &extra->list_subscribe;
+	slots[FIELD_LIST_UNSUBSCRIBE] = &extra->list_unsubscribe;
+	slots[FIELD_LIST_HELP] = &extra->list_help;
+	slots[FIELD_LIST_ARCHIVE] = &extra->list_archive;
+	slots[FIELD_LIST_OWNER] = &extra->list_owner;
+	slots[FIELD_RESENT_FROM] = &extra->resent_from;
+}
+
+static guint32 get_u32(const guchar *p)
+{
+	guint32 v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static gint64 get_i64(const guchar *p)
+{
+	gint64 v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static void append_u32(GByteArray *rec, guint32 v)
+{
+	g_byte_array_append(rec, (guint8 *) &v, sizeof(v));
+}
+
+static void append_i64(GByteArray *rec, gint64 v)
+{
+	g_byte_array_append(rec, (guint8 *) &v, sizeof(v));
+}
+
+static void append_str(GByteArray *rec, const gchar *str)
+{
+	g_byte_array_append(rec, (const guint8 *) str, strlen(str) + 1);
+}
+
+/* Checks that a record has the header and all NUL terminated strings it
+ * claims within size bytes */
+static gboolean record_valid(const guchar *rec, guint32 size)
+{
+	const guchar *p, *end = rec + size;
+	guint32 mask;
+	gint i;
+
+	if (size < RECORD_HEADER_SIZE)
+		return FALSE;
+	mask = get_u32(rec + RECORD_HEADER_SIZE - 4);
+
+	p = rec + RECORD_HEADER_SIZE;
+	for (i = -1; i < FIELD_COUNT; i++) {
+		if (i >= 0 && !(mask & (1 << i)))
+			continue;
+		if ((p = memchr(p, '\0', end - p)) == NULL)
+			return FALSE;
+		p++;
+	}
+
+	return TRUE;
+}
+
+static void map_file(SummaryCache *cache)
+{
+	struct stat st;
+	const guchar *p, *end;
+	gint fd;
+
+	if ((fd = open(cache->file, O_RDONLY)) < 0)
+		return;
+	if (fstat(fd, &st) < 0 || st.st_size < CACHE_HEADER_SIZE) {
+		close(fd);
+		return;
+	}
+
+	cache->maplen = st.st_size;
+	cache->map = mmap(NULL, cache->maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (cache->map == MAP_FAILED) {
+		cache->map = NULL;
+		return;
+	}
+
+	if (memcmp(cache->map, CACHE_MAGIC, 4) ||
+	    get_u32(cache->map + 4) != CACHE_VERSION) {
+		debug_print("ignoring summary cache %s of another version\n", cache->file);
+		return;
+	}
+
+	p = cache->map + CACHE_HEADER_SIZE;
+	end = cache->map + cache->maplen;
+	while (end - p >= 4) {
+		guint32 size = get_u32(p);
+
+		if (size > end - p || !record_valid(p, size)) {
+			g_warning("Maildir: summary cache %s is damaged\n", cache->file);
+			break;
+		}
+		g_hash_table_replace(cache->mapped,
+				     (gpointer) (p + RECORD_HEADER_SIZE), (gpointer) p);
+		p += size;
+	}
+}
+
+SummaryCache *summary_cache_open(const gchar *file)
+{
+	SummaryCache *cache;
+
+	cache = g_new0(SummaryCache, 1);
+	cache->file = g_strdup(file);
+	cache->mapped = g_hash_table_new(g_str_hash, g_str_equal);
+	cache->added = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+					     (GDestroyNotify) g_byte_array_unref);
+	map_file(cache);
+
+	return cache;
+}
+
+void summary_cache_close(SummaryCache *cache)
+{
+	g_return_if_fail(cache != NULL);
+
+	g_hash_table_destroy(cache->added);
+	g_hash_table_destroy(cache->mapped);
+	if (cache->map != NULL)
+		munmap(cache->map, cache->maplen);
+	g_free(cache->file);
+	g_free(cache);
+}
+
+static const guchar *lookup(SummaryCache *cache, const gchar *uniq)
+{
+	GByteArray *rec;
+
+	if ((rec = g_hash_table_lookup(cache->added, uniq)) != NULL)
+		return rec->data;
+
+	return g_hash_table_lookup(cache->mapped, uniq);
+}
+
+/* Returns a MsgInfo for the message with the uniq if the cache has an
+ * entry for a file of that size and mtime */
+MsgInfo *summary_cache_get(SummaryCache *cache, const gchar *uniq,
+			   goffset size, time_t mtime)
+{
+	const guchar *rec, *p;
+	MsgInfo *msginfo;
+	gchar **slots[FIELD_COUNT];
+	guint32 mask;
+	gint i;
+
+	g_return_val_if_fail(cache != NULL, NULL);
+
+	if ((rec = lookup(cache, uniq)) == NULL)
+		return NULL;
+	if (get_i64(rec + 4) != size || get_i64(rec + 12) != mtime)
+		return NULL;
+
+	msginfo = procmsg_msginfo_new();
+	msginfo->size = size;
+	msginfo->mtime = mtime;
+	msginfo->date_t = get_i64(rec + 20);
+	msginfo->thread_date = get_i64(rec + 28);
+	msginfo->flags.perm_flags = get_u32(rec + 36);
+	msginfo->flags.tmp_flags = get_u32(rec + 40);
+	mask = get_u32(rec + 44);
+	if (mask >> FIELD_EXTRADATA)
+		msginfo->extradata = g_new0(MsgInfoExtraData, 1);
+	get_slots(msginfo, slots);
+
+	p = rec + RECORD_HEADER_SIZE;
+	p += strlen((const gchar *) p) + 1;	/* uniq */
+	for (i = 0; i < FIELD_COUNT; i++) {
+		const gchar *str = (const gchar *) p;
+		gchar **lines, **line;
+
+		if (!(mask & (1 << i)))
+			continue;
+		p += strlen(str) + 1;
+
+		switch (i) {
+		case FIELD_REFERENCES:
+			lines = g_strsplit(str, "\n", 0);
+			for (line = lines; *line != NULL; line++)
+				msginfo->references = g_slist_prepend(msginfo->references,
+								      g_strdup(*line));
+			msginfo->references = g_slist_reverse(msginfo->references);
+			g_strfreev(lines);
+			break;
+		case FIELD_AVATARS:
+			lines = g_strsplit(str, "\n", 0);
+			for (line = lines; *line != NULL; line++) {
+				gchar *src = strchr(*line, ' ');
+
+				if (src != NULL)
+					procmsg_msginfo_add_avatar(msginfo, atoi(*line), src + 1);
+			}
+			g_strfreev(lines);
+			break;
+		default:
+			*slots[i] = g_strdup(str);
+		}
+	}
+
+	return msginfo;
+}
+
+/* Remembers the fields of msginfo, which was parsed from the current
+ * file of the message with the uniq */
+void summary_cache_put(SummaryCache *cache, const gchar *uniq, MsgInfo *msginfo)
+{
+	GByteArray *rec;
+	gchar **slots[FIELD_COUNT];
+	GString *refs = NULL, *avatars = NULL;
+	GSList *cur;
+	guint32 mask = 0, size;
+	gint i;
+
+	g_return_if_fail(cache != NULL);
+	g_return_if_fail(msginfo != NULL);
+
+	get_slots(msginfo, slots);
+	for (i = 0; i < FIELD_COUNT; i++)
+		if (slots[i] != NULL && *slots[i] != NULL)
+			mask |= 1 << i;
+
+	if (msginfo->references != NULL) {
+		refs = g_string_new(NULL);
+		for (cur = msginfo->references; cur != NULL; cur = g_slist_next(cur))
+			g_string_append_printf(refs, "%s%s", refs->len ? "\n" : "",
+					       (gchar *) cur->data);
+		mask |= 1 << FIELD_REFERENCES;
+	}
+	if (msginfo->extradata != NULL && msginfo->extradata->avatars != NULL) {
+		avatars = g_string_new(NULL);
+		for (cur = msginfo->extradata->avatars; cur != NULL; cur = g_slist_next(cur)) {
+			MsgInfoAvatar *avatar = (MsgInfoAvatar *) cur->data;
+
+			g_string_append_printf(avatars, "%s%d %s", avatars->len ? "\n" : "",
+					       avatar->avatar_id, avatar->avatar_src);
+		}
+		mask |= 1 << FIELD_AVATARS;
+	}
+
+	rec = g_byte_array_new();
+	append_u32(rec, 0);
+	append_i64(rec, msginfo->size);
+	append_i64(rec, msginfo->mtime);
+	append_i64(rec, msginfo->date_t);
+	append_i64(rec, msginfo->thread_date);
+	append_u32(rec, msginfo->flags.perm_flags);
+	append_u32(rec, msginfo->flags.tmp_flags);
+	append_u32(rec, mask);
+	append_str(rec, uniq);
+	for (i = 0; i < FIELD_COUNT; i++) {
+		if (!(mask & (1 << i)))
+			continue;
+		if (i == FIELD_REFERENCES)
+			append_str(rec, refs->str);
+		else if (i == FIELD_AVATARS)
+			append_str(rec, avatars->str);
+		else
+			append_str(rec, *slots[i]);
+	}
+	size = rec->len;
+	memcpy(rec->data, &size, sizeof(size));
+
+	if (refs != NULL)
+		g_string_free(refs, TRUE);
+	if (avatars != NULL)
+		g_string_free(avatars, TRUE);
+
+	g_hash_table_replace(cache->added, g_strdup(uniq), rec);
+	cache->dirty = TRUE;
+}
+
+struct SaveData
+{
+	FILE			*fp;
+	SummaryCache		*cache;
+	SummaryCacheKeepFunc	 keep;
+	gpointer		 data;
+	gboolean		 ok;
+};
+
+static void save_mapped(gpointer key, gpointer value, gpointer userdata)
+{
+	struct SaveData *save = userdata;
+	const guchar *rec = value;
+
+	if (!save->ok || g_hash_table_lookup(save->cache->added, key) != NULL ||
+	    !save->keep((const gchar *) key, save->data))
+		return;
+	if (fwrite(rec, get_u32(rec), 1, save->fp) != 1)
+		save->ok = FALSE;
+}
+
+static void save_added(gpointer key, gpointer value, gpointer userdata)
+{
+	struct SaveData *save = userdata;
+	GByteArray *rec = value;
+
+	if (!save->ok || !save->keep((const gchar *) key, save->data))
+		return;
+	if (fwrite(rec->data, rec->len, 1, save->fp) != 1)
+		save->ok = FALSE;
+}
+
+/* Writes the entries for which keep returns TRUE to a new file if
+ * anything was added since the cache was opened or last saved */
+void summary_cache_save(SummaryCache *cache, SummaryCacheKeepFunc keep, gpointer data)
+{
+	struct SaveData save;
+	gchar *tmpfile;
+	guint32 version = CACHE_VERSION;
+
+	g_return_if_fail(cache != NULL);
+
+	if (!cache->dirty)
+		return;
+
+	tmpfile = g_strconcat(cache->file, ".tmp", NULL);
+	if ((save.fp = fopen(tmpfile, "wb")) == NULL) {
+		FILE_OP_ERROR(tmpfile, "fopen");
+		g_free(tmpfile);
+		return;
+	}
+	save.cache = cache;
+	save.keep = keep;
+	save.data = data;
+	save.ok = fwrite(CACHE_MAGIC, 4, 1, save.fp) == 1 &&
+		  fwrite(&version, sizeof(version), 1, save.fp) == 1;
+
+	/* the old mapping stays valid after the rename */
+	g_hash_table_foreach(cache->mapped, save_mapped, &save);
+	g_hash_table_foreach(cache->added, save_added, &save);
+
+	if (fclose(save.fp) == EOF)
+		save.ok = FALSE;
+	if (save.ok && rename(tmpfile, cache->file) == 0)
+		cache->dirty = FALSE;
+	else {
+		FILE_OP_ERROR(cache->file, "write");
+		unlink(tmpfile);
+	}
+	g_free(tmpfile);
+}
@@ -0,0 +1,42 @@
+/*
+ * Maildir Plugin -- Maildir++ support for Sylpheed
+ * Copyright (C) 2003 Christoph Hohmann
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+
+#ifndef SUMMARYCACHE_H
+#define SUMMARYCACHE_H 1
+
+#include <glib.h>
+#include <sys/types.h>
+
+#include "procmsg.h"
+
+#define SUMMARY_CACHE_FILE	"sylpheed_summary.cache"
+
+typedef struct _SummaryCache SummaryCache;
+
+/* Decides whether the entry of a message is kept when the cache is saved */
+typedef gboolean (*SummaryCacheKeepFunc) (const gchar *uniq, gpointer data);
+
+SummaryCache *summary_cache_open(const gchar *);
+void summary_cache_close(SummaryCache *);
+void summary_cache_save(SummaryCache *, SummaryCacheKeepFunc, gpointer);
+MsgInfo *summary_cache_get(SummaryCache *, const gchar *, goffset, time_t);
+void summary_cache_put(SummaryCache *, const gchar *, MsgInfo *);
+
+#endif /* SUMMARYCACHE_H */
@@ -17,109 +17,395 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 
+#include "pluginconfig.h"
+
 #include <glib.h>
-#include <db.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "utils.h"
 #include "uiddb.h"
+#include "uiddb_backend.h"
+
+#ifndef DEFAULT_UIDDB_BACKEND
+#define DEFAULT_UIDDB_BACKEND "bdb"
+#endif
 
+/*
+ * While a UIDDB is open all records are kept in memory, indexed by UID
+ * and by uniq. Changes are applied there and only remembered as dirty
+ * UIDs, which are written to the backend in one group some time later
+ * or when the UIDDB is closed.
+ */
 struct _UIDDB
 {
-	DB	*db_uid;
-	DB	*db_uniq;
-	guint32	 lastuid;
+	UIDDBBackend	*backend;
+	UIDDBStore	*store;
+	guint32		 lastuid;
+	guint32		 uidlimit;	/* the last UID on disk, at or above
+					 * lastuid while UIDs are reserved */
+	guint32		 uidvalidity;
+	gboolean	 changed;
+	gpointer	 buf;		/* reusable buffer for marshalled records */
+	guint32		 buflen;
+
+	GPtrArray	*records;	/* marshalled records, indexed by UID
+					 * from uidbase on */
+	guint32		 uidbase;
+	GHashTable	*uniqs;		/* uniq -> record */
+	GHashTable	*dirty;		/* UIDs changed since the last flush */
+	gboolean	 cleared;	/* backend has to be cleared first */
+	guint		 flush_timer;
+};
+
+#define META_LASTUID		"lastuid"
+#define META_UIDVALIDITY	"uidvalidity"
+
+#define FLUSH_DELAY		2	/* seconds before changes are written */
+#define UID_RESERVE		64	/* UIDs reserved on disk at once */
+#define RECORDS_GROW_MAX	4096	/* slots added to the records at most */
+
+#define RECORD_DIR_NEW		0
+#define RECORD_DIR_CUR		1
+#define RECORD_DIR_TMP		2
+
+/* indexed by UIDDBBackendType, NULL if not compiled in */
+static UIDDBBackend *backends[UIDDB_BACKEND_COUNT] = {
+	&uiddb_bdb_backend,
+#ifdef HAVE_LMDB
+	&uiddb_lmdb_backend,
+#else
+	NULL,
+#endif
+};
+
+static const gchar *backend_names[UIDDB_BACKEND_COUNT] = {
+	"bdb",
+	"lmdb",
+};
+
+static const gchar *backend_filenames[UIDDB_BACKEND_COUNT] = {
+	"sylpheed_uid.db",
+	"sylpheed_uid.mdb",
 };
 
 static gboolean initialized = FALSE;
-static DB_ENV *dbenv;
 
 void uiddb_init()
 {
-	db_env_create(&dbenv, 0);
-	dbenv->open(dbenv, get_tmp_dir(), DB_INIT_MPOOL | DB_INIT_CDB | DB_CREATE, 0600);
+	gint i;
+
+	for (i = 0; i < UIDDB_BACKEND_COUNT; i++)
+		if (backends[i] != NULL && !backends[i]->init()) {
+			g_warning("UID database backend %s not available\n",
+				  backend_names[i]);
+			backends[i] = NULL;
+		}
 
 	initialized = TRUE;
 }
 
 void uiddb_done()
 {
-	dbenv->close(dbenv, 0);
+	gint i;
+
+	for (i = 0; i < UIDDB_BACKEND_COUNT; i++)
+		if (backends[i] != NULL)
+			backends[i]->done();
 
 	initialized = FALSE;
 }
 
-int get_secondary_key(DB *dbp, const DBT *pkey, const DBT *pdata, DBT *skey)
+gboolean uiddb_backend_available(UIDDBBackendType type)
 {
-	gchar *uniq;
+	return (guint) type < UIDDB_BACKEND_COUNT && backends[type] != NULL;
+}
 
-	memset(skey, 0, sizeof(DBT));
+UIDDBBackendType uiddb_backend_from_name(const gchar *name)
+{
+	UIDDBBackendType type;
 
-	uniq = pdata->data + sizeof(guint32);
-	skey->data = uniq;
-	skey->size = strlen(uniq);
+	for (type = 0; type < UIDDB_BACKEND_COUNT; type++)
+		if (name != NULL && !strcmp(backend_names[type], name))
+			return type;
 
-	return 0;
+	return UIDDB_BACKEND_BDB;
 }
 
-UIDDB *uiddb_open(const gchar *dbfile)
+const gchar *uiddb_backend_get_name(UIDDBBackendType type)
 {
-	gint	 ret;
-	DB	*db_uid, *db_uniq;
-	UIDDB	*uiddb;
+	g_return_val_if_fail((guint) type < UIDDB_BACKEND_COUNT, NULL);
 
-	g_return_val_if_fail(initialized, NULL);
+	return backend_names[type];
+}
 
-	/* open uid key based database */
-	if ((ret = db_create(&db_uid, dbenv, 0)) != 0) {
-		debug_print("db_create: %s\n", db_strerror(ret));
-		return NULL;
-	}
-	if ((ret = db_uid->open(db_uid, NULL, dbfile, "uidkey", DB_BTREE, DB_CREATE, 0600)) != 0) {
-		debug_print("DB->open: %s\n", db_strerror(ret));
-		db_uid->close(db_uid, 0);
-		return NULL;
+/* The file names do not depend on the backend being compiled in, so
+ * that databases of unavailable backends can still be found */
+const gchar *uiddb_backend_get_filename(UIDDBBackendType type)
+{
+	g_return_val_if_fail((guint) type < UIDDB_BACKEND_COUNT, NULL);
+
+	return backend_filenames[type];
+}
+
+UIDDBBackendType uiddb_backend_get_default(void)
+{
+	UIDDBBackendType type;
+
+	type = uiddb_backend_from_name(DEFAULT_UIDDB_BACKEND);
+	if (!uiddb_backend_available(type))
+		type = UIDDB_BACKEND_BDB;
+
+	return type;
+}
+
+static guint32 record_size(const void *data)
+{
+	const gchar *uniq, *raw;
+
+	uniq = RECORD_UNIQ(data);
+	raw = uniq + strlen(uniq) + 1;
+
+	return raw + strlen(raw) + 1 - (const gchar *) data;
+}
+
+/* Makes room for uid in the records. The array starts at the lowest
+ * UID, so its size follows the range of UIDs in use rather than the
+ * highest one. */
+static void grow_records(UIDDB *uiddb, guint32 uid)
+{
+	GPtrArray *records = uiddb->records;
+	guint len = records->len;
+
+	if (len == 0)
+		uiddb->uidbase = uid;
+
+	if (uid < uiddb->uidbase) {
+		guint shift = uiddb->uidbase - uid;
+
+		g_ptr_array_set_size(records, len + shift);
+		memmove(records->pdata + shift, records->pdata, len * sizeof(gpointer));
+		memset(records->pdata, 0, shift * sizeof(gpointer));
+		uiddb->uidbase = uid;
+	} else if (uid - uiddb->uidbase >= len) {
+		g_ptr_array_set_size(records, MAX(uid - uiddb->uidbase + 1,
+						  MIN(len * 2, len + RECORDS_GROW_MAX)));
 	}
-	debug_print("UID based database opened\n");
+}
 
-	/* open uniq key based database */
-	if ((ret = db_create(&db_uniq, dbenv, 0)) != 0) {
-		debug_print("db_create: %s\n", db_strerror(ret));
-		db_uid->close(db_uid, 0);
+/* Drops the empty slots below the lowest record left */
+static void trim_records(UIDDB *uiddb)
+{
+	GPtrArray *records = uiddb->records;
+	guint first;
+
+	for (first = 0; first < records->len; first++)
+		if (g_ptr_array_index(records, first) != NULL)
+			break;
+	if (first == 0)
+		return;
+
+	memmove(records->pdata, records->pdata + first,
+		(records->len - first) * sizeof(gpointer));
+	g_ptr_array_set_size(records, records->len - first);
+	uiddb->uidbase += first;
+}
+
+/* Takes over data as the record for uid */
+static void set_record(UIDDB *uiddb, guint32 uid, gpointer data)
+{
+	grow_records(uiddb, uid);
+
+	g_ptr_array_index(uiddb->records, uid - uiddb->uidbase) = data;
+	/* the key belongs to the record, replace it along with the value */
+	g_hash_table_replace(uiddb->uniqs, (gchar *) RECORD_UNIQ(data), data);
+}
+
+static gpointer get_record(UIDDB *uiddb, guint32 uid)
+{
+	if (uid < uiddb->uidbase || uid - uiddb->uidbase >= uiddb->records->len)
 		return NULL;
+
+	return g_ptr_array_index(uiddb->records, uid - uiddb->uidbase);
+}
+
+static void free_record(UIDDB *uiddb, guint32 uid)
+{
+	gpointer data;
+
+	if ((data = get_record(uiddb, uid)) == NULL)
+		return;
+
+	/* the uniq may have moved on to a newer record */
+	if (g_hash_table_lookup(uiddb->uniqs, RECORD_UNIQ(data)) == data)
+		g_hash_table_remove(uiddb->uniqs, RECORD_UNIQ(data));
+	g_ptr_array_index(uiddb->records, uid - uiddb->uidbase) = NULL;
+	g_free(data);
+}
+
+static void load_record(guint32 uid, const void *data, guint32 size,
+			gpointer userdata)
+{
+	set_record((UIDDB *) userdata, uid, g_memdup(data, size));
+}
+
+struct FlushData
+{
+	UIDDB	*uiddb;
+	GArray	*deleted;
+};
+
+static void flush_uid(gpointer key, gpointer value, gpointer userdata)
+{
+	struct FlushData *flush = userdata;
+	guint32 uid = GPOINTER_TO_UINT(key);
+	gpointer data;
+
+	if ((data = get_record(flush->uiddb, uid)) != NULL)
+		flush->uiddb->backend->put(flush->uiddb->store, uid, data,
+					   record_size(data));
+	else if (!flush->uiddb->cleared)
+		g_array_append_val(flush->deleted, uid);
+}
+
+/* Writes all pending changes to the backend in one group */
+void uiddb_flush(UIDDB *uiddb)
+{
+	struct FlushData flush;
+
+	g_return_if_fail(uiddb != NULL);
+
+	if (uiddb->flush_timer != 0) {
+		g_source_remove(uiddb->flush_timer);
+		uiddb->flush_timer = 0;
 	}
-	if ((ret = db_uniq->open(db_uniq, NULL, dbfile, "uniqkey", DB_BTREE, DB_CREATE, 0600)) != 0) {
-		debug_print("DB->open: %s\n", db_strerror(ret));
-		db_uniq->close(db_uniq, 0);
-		db_uid->close(db_uid, 0);
-		return NULL;
+	if (!uiddb->cleared && g_hash_table_size(uiddb->dirty) == 0 &&
+	    uiddb->uidlimit == uiddb->lastuid)
+		return;
+
+	flush.uiddb = uiddb;
+	flush.deleted = g_array_new(FALSE, FALSE, sizeof(guint32));
+
+	uiddb->backend->begin(uiddb->store);
+	if (uiddb->cleared)
+		uiddb->backend->clear(uiddb->store);
+	g_hash_table_foreach(uiddb->dirty, flush_uid, &flush);
+	uiddb->backend->del_uids(uiddb->store, (guint32 *) flush.deleted->data,
+				 flush.deleted->len);
+	/* give back what is left of the reserved UIDs */
+	if (uiddb->uidlimit != uiddb->lastuid)
+		uiddb->backend->put_meta(uiddb->store, META_LASTUID, uiddb->lastuid);
+	g_array_free(flush.deleted, TRUE);
+	if (!uiddb->backend->end(uiddb->store)) {
+		/* keep the changes for the next attempt */
+		g_warning("writing UID database failed\n");
+		return;
 	}
-	debug_print("Uniq based database opened\n");
 
-	if ((ret = db_uid->associate(db_uid, NULL, db_uniq, get_secondary_key, 0)) != 0) {
-		debug_print("DB->associate: %s\n", db_strerror(ret));
-		db_uid->close(db_uid, 0);
-		db_uniq->close(db_uniq, 0);
+	debug_print("flushed %d changed UIDs\n", g_hash_table_size(uiddb->dirty));
+	uiddb->uidlimit = uiddb->lastuid;
+	g_hash_table_remove_all(uiddb->dirty);
+	uiddb->cleared = FALSE;
+}
+
+static gboolean flush_timeout_cb(gpointer data)
+{
+	UIDDB *uiddb = data;
+
+	uiddb->flush_timer = 0;
+	uiddb_flush(uiddb);
+	/* try again later if writing failed */
+	if (uiddb->cleared || g_hash_table_size(uiddb->dirty) > 0)
+		uiddb->flush_timer = g_timeout_add_seconds(FLUSH_DELAY,
+							   flush_timeout_cb, uiddb);
+
+	return FALSE;
+}
+
+static void schedule_flush(UIDDB *uiddb)
+{
+	uiddb->changed = TRUE;
+
+	if (uiddb->flush_timer == 0)
+		uiddb->flush_timer = g_timeout_add_seconds(FLUSH_DELAY,
+							   flush_timeout_cb, uiddb);
+}
+
+static void mark_dirty(UIDDB *uiddb, guint32 uid)
+{
+	g_hash_table_insert(uiddb->dirty, GUINT_TO_POINTER(uid), NULL);
+	schedule_flush(uiddb);
+}
+
+UIDDB *uiddb_open(UIDDBBackendType type, const gchar *dbfile)
+{
+	UIDDBBackend	*backend;
+	UIDDBStore	*store;
+	UIDDB		*uiddb;
+
+	g_return_val_if_fail(initialized, NULL);
+	g_return_val_if_fail(uiddb_backend_available(type), NULL);
+
+	backend = backends[type];
+	if ((store = backend->open(dbfile)) == NULL)
 		return NULL;
-	}
-	debug_print("Databases associated\n");
 
 	uiddb = g_new0(UIDDB, 1);
-	uiddb->db_uid = db_uid;
-	uiddb->db_uniq = db_uniq;
+	uiddb->backend = backend;
+	uiddb->store = store;
 	uiddb->lastuid = 0;
+	uiddb->records = g_ptr_array_new();
+	uiddb->uniqs = g_hash_table_new(g_str_hash, g_str_equal);
+	uiddb->dirty = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	/* one bulk load instead of a lookup for every file */
+	backend->foreach(store, load_record, uiddb);
+
+	if (!backend->get_meta(store, META_LASTUID, &uiddb->lastuid)) {
+		/* only needed once for databases created before the last
+		 * UID was stored */
+		for (uiddb->lastuid = uiddb->uidbase + uiddb->records->len; uiddb->lastuid > 0; uiddb->lastuid--)
+			if (get_record(uiddb, uiddb->lastuid) != NULL)
+				break;
+		backend->put_meta(store, META_LASTUID, uiddb->lastuid);
+	}
+	uiddb->uidlimit = uiddb->lastuid;
+	if (!backend->get_meta(store, META_UIDVALIDITY, &uiddb->uidvalidity)) {
+		uiddb->uidvalidity = time(NULL);
+		backend->put_meta(store, META_UIDVALIDITY, uiddb->uidvalidity);
+	}
 
 	return uiddb;
 }
 
 void uiddb_close(UIDDB *uiddb)
 {
+	guint32 uid;
+
 	g_return_if_fail(uiddb != NULL);
 
-	if (uiddb->db_uid != NULL)
-		uiddb->db_uid->close(uiddb->db_uid, 0);
-	if (uiddb->db_uniq != NULL)
-		uiddb->db_uniq->close(uiddb->db_uniq, 0);
+	uiddb_flush(uiddb);
+	uiddb->backend->close(uiddb->store);
+
+	for (uid = 0; uid < uiddb->records->len; uid++)
+		g_free(g_ptr_array_index(uiddb->records, uid));
+	g_ptr_array_free(uiddb->records, TRUE);
+	g_hash_table_destroy(uiddb->uniqs);
+	g_hash_table_destroy(uiddb->dirty);
+	g_free(uiddb->buf);
+	g_free(uiddb);
+}
+
+gboolean uiddb_take_changed(UIDDB *uiddb)
+{
+	gboolean changed;
+
+	g_return_val_if_fail(uiddb != NULL, FALSE);
+
+	changed = uiddb->changed;
+	uiddb->changed = FALSE;
+
+	return changed;
 }
 
 void uiddb_free_msgdata(MessageData *msgdata)
@@ -130,19 +416,82 @@ void uiddb_free_msgdata(MessageData *msgdata)
 	g_free(msgdata);
 }
 
-static DBT marshal(MessageData *msgdata)
+/* Maildir directories, stored as one byte in the record */
+static const gchar *record_dirs[] = { "new", "cur", "tmp" };
+
+static guint8 get_dir_index(const gchar *dir)
+{
+	guint8 i;
+
+	for (i = 0; i < G_N_ELEMENTS(record_dirs); i++)
+		if (!strcmp(record_dirs[i], dir))
+			return i;
+
+	debug_print("unknown maildir subdirectory %s\n", dir);
+	return RECORD_DIR_CUR;
+}
+
+/* Maps the info part of a file name to a flag bitmask. raw is set to
+ * info if the bitmask alone can not reproduce it, e.g. for unknown
+ * flags or flags out of order, and to the empty string otherwise. */
+static guint8 parse_info(const gchar *info, const gchar **raw)
 {
-	DBT dbt;
-	gpointer ptr;
+	const gchar *ptr;
+	guint8 flags;
+	gchar last = '\0';
+	gboolean needraw = FALSE;
+
+	*raw = info;
+	if (info[0] == '\0')
+		return 0;
+	if (info[0] != '2' || info[1] != ',')
+		return 0;
+
+	flags = MAILDIR_INFO_V2;
+	for (ptr = info + 2; *ptr != '\0'; ptr++) {
+		switch (*ptr) {
+		case 'D': flags |= MAILDIR_INFO_DRAFT; break;
+		case 'F': flags |= MAILDIR_INFO_FLAGGED; break;
+		case 'P': flags |= MAILDIR_INFO_PASSED; break;
+		case 'R': flags |= MAILDIR_INFO_REPLIED; break;
+		case 'S': flags |= MAILDIR_INFO_SEEN; break;
+		case 'T': flags |= MAILDIR_INFO_TRASHED; break;
+		default:
+			needraw = TRUE;
+			break;
+		}
+		if (*ptr <= last)
+			needraw = TRUE;
+		last = *ptr;
+	}
+	if (!needraw)
+		*raw = "";
 
-	memset(&dbt, 0, sizeof(dbt));
-	dbt.size = sizeof(msgdata->uid) + \
-		   strlen(msgdata->uniq) + 1 + \
-		   strlen(msgdata->info) + 1 + \
-		   strlen(msgdata->dir) + 1;
-	dbt.data = g_malloc0(dbt.size);
+	return flags;
+}
+
+/* Serializes msgdata into *buf, which is grown as needed, and returns
+ * the size of the record */
+static guint32 marshal(MessageData *msgdata, gpointer *buf, guint32 *buflen)
+{
+	gsize uniqlen, rawlen;
+	const gchar *raw;
+	guint8 dir, flags;
+	guint32 size;
+	gchar *ptr;
+
+	dir = get_dir_index(msgdata->dir);
+	flags = parse_info(msgdata->info, &raw);
+	uniqlen = strlen(msgdata->uniq) + 1;
+	rawlen = strlen(raw) + 1;
+
+	size = RECORD_HEADER_SIZE + uniqlen + rawlen;
+	if (size > *buflen) {
+		*buflen = MAX(size, 256);
+		*buf = g_realloc(*buf, *buflen);
+	}
 
-	ptr = dbt.data;
+	ptr = *buf;
 
 #define ADD_DATA(dataptr, size) \
 { \
@@ -151,187 +500,416 @@ static DBT marshal(MessageData *msgdata)
 }
 
 	ADD_DATA(&msgdata->uid, sizeof(msgdata->uid));
-	ADD_DATA(msgdata->uniq, strlen(msgdata->uniq) + 1);
-	ADD_DATA(msgdata->info, strlen(msgdata->info) + 1);
-	ADD_DATA(msgdata->dir, strlen(msgdata->dir) + 1);
+	ADD_DATA(&dir, 1);
+	ADD_DATA(&flags, 1);
+	ADD_DATA(msgdata->uniq, uniqlen);
+	ADD_DATA(raw, rawlen);
 
 #undef ADD_DATA	
 
-	return dbt;
+	return size;
 }
 
-static MessageData *unmarshal(DBT dbt)
+/* Converts a record of the first version, the uid followed by uniq,
+ * info and dir as strings */
+guint32 uiddb_record_from_v1(const void *data, gpointer *buf, guint32 *buflen)
 {
-	gpointer ptr;
-	MessageData *msgdata;
-
-	ptr = dbt.data;
-	msgdata = g_new0(MessageData, 1);
+	MessageData msgdata;
+	gchar *ptr = (gchar *) data;
 
-	memcpy(&msgdata->uid, ptr, sizeof(msgdata->uid));
-	ptr += sizeof(msgdata->uid);
-	msgdata->uniq = g_strdup(ptr);
+	memcpy(&msgdata.uid, ptr, sizeof(msgdata.uid));
+	ptr += sizeof(msgdata.uid);
+	msgdata.uniq = ptr;
 	ptr += strlen(ptr) + 1;
-	msgdata->info = g_strdup(ptr);
+	msgdata.info = ptr;
 	ptr += strlen(ptr) + 1;
-	msgdata->dir = g_strdup(ptr);
+	msgdata.dir = ptr;
+
+	return marshal(&msgdata, buf, buflen);
+}
+
+/* Points view into the record without copying anything */
+static void unmarshal_view(const void *data, MessageDataView *view)
+{
+	const guint8 *ptr;
+
+	ptr = data;
+
+	memcpy(&view->uid, ptr, sizeof(view->uid));
+	ptr += sizeof(view->uid);
+	view->dir = record_dirs[MIN(ptr[0], RECORD_DIR_TMP)];
+	view->flags = ptr[1];
+	ptr += 2;
+	view->uniq = (const gchar *) ptr;
+	view->raw = view->uniq + strlen(view->uniq) + 1;
+}
+
+gboolean uiddb_view_info_equal(const MessageDataView *view, const gchar *info)
+{
+	const gchar *raw;
+
+	return parse_info(info, &raw) == view->flags && !strcmp(raw, view->raw);
+}
+
+gchar *uiddb_view_get_info(const MessageDataView *view)
+{
+	if (view->raw[0] != '\0' || !(view->flags & MAILDIR_INFO_V2))
+		return g_strdup(view->raw);
+
+	return g_strconcat("2,",
+		view->flags & MAILDIR_INFO_DRAFT   ? "D" : "",
+		view->flags & MAILDIR_INFO_FLAGGED ? "F" : "",
+		view->flags & MAILDIR_INFO_PASSED  ? "P" : "",
+		view->flags & MAILDIR_INFO_REPLIED ? "R" : "",
+		view->flags & MAILDIR_INFO_SEEN    ? "S" : "",
+		view->flags & MAILDIR_INFO_TRASHED ? "T" : "",
+		NULL);
+}
+
+MessageData *uiddb_copy_msgdata(const MessageDataView *view)
+{
+	MessageData *msgdata;
+
+	msgdata = g_new0(MessageData, 1);
+	msgdata->uid = view->uid;
+	msgdata->uniq = g_strdup(view->uniq);
+	msgdata->info = uiddb_view_get_info(view);
+	msgdata->dir = g_strdup(view->dir);
 
 	return msgdata;
 }
 
+static MessageData *unmarshal(const void *data)
+{
+	MessageDataView view;
+
+	unmarshal_view(data, &view);
+
+	return uiddb_copy_msgdata(&view);
+}
+
 guint32 uiddb_get_new_uid(UIDDB *uiddb)
 {
-	DBC *cursor;
-	DBT key, data;
-	gint ret;
-	guint32 uid, lastuid = -1;
+	return uiddb_reserve_uids(uiddb, 1);
+}
+
+guint32 uiddb_reserve_uids(UIDDB *uiddb, guint count)
+{
+	guint32 first;
 
 	g_return_val_if_fail(uiddb != NULL, 0);
+	g_return_val_if_fail(count > 0, 0);
+
+	/* the reserved range reaches the disk before any of its UIDs is
+	 * handed out; after a crash at most the rest of it is skipped */
+	first = uiddb->lastuid + 1;
+	uiddb->lastuid += count;
+	if (uiddb->lastuid > uiddb->uidlimit) {
+		uiddb->uidlimit = uiddb->lastuid + UID_RESERVE;
+		uiddb->backend->put_meta(uiddb->store, META_LASTUID, uiddb->uidlimit);
+	}
 
-	lastuid = uiddb->lastuid;
+	return first;
+}
 
-	if (uiddb->lastuid > 0)
-		return ++uiddb->lastuid;
+guint32 uiddb_get_uidvalidity(UIDDB *uiddb)
+{
+	g_return_val_if_fail(uiddb != NULL, 0);
 
-	ret = uiddb->db_uid->cursor(uiddb->db_uid, NULL, &cursor, 0);
-	if (ret != 0) {
-		debug_print("DB->cursor: %s\n", db_strerror(ret));
-		return -1;
-	}
+	return uiddb->uidvalidity;
+}
 
-	memset(&key, 0, sizeof(key));
-	memset(&data, 0, sizeof(data));
-	while ((ret = cursor->c_get(cursor, &key, &data, DB_NEXT)) == 0) {
-		uid = *((guint32 *) key.data);
+void uiddb_set_uidvalidity(UIDDB *uiddb, guint32 uidvalidity)
+{
+	g_return_if_fail(uiddb != NULL);
 
-		if (uid > lastuid)
-			lastuid = uid;		
+	uiddb->uidvalidity = uidvalidity;
+	uiddb->backend->put_meta(uiddb->store, META_UIDVALIDITY, uidvalidity);
+}
 
-		memset(&key, 0, sizeof(key));
-		memset(&data, 0, sizeof(data));
-	}
+/* Makes sure new UIDs are above lastuid, for UIDs handed out elsewhere */
+void uiddb_raise_last_uid(UIDDB *uiddb, guint32 lastuid)
+{
+	g_return_if_fail(uiddb != NULL);
 
-	cursor->c_close(cursor);
+	if (lastuid <= uiddb->lastuid)
+		return;
 
-	uiddb->lastuid = ++lastuid;
-	return lastuid;
+	uiddb->lastuid = lastuid;
+	if (uiddb->lastuid > uiddb->uidlimit) {
+		uiddb->uidlimit = uiddb->lastuid;
+		uiddb->backend->put_meta(uiddb->store, META_LASTUID, uiddb->uidlimit);
+	}
 }
 
-MessageData *uiddb_get_entry_for_uid(UIDDB *uiddb, guint32 uid)
+MsgNumberList *uiddb_get_uids(UIDDB *uiddb)
 {
-	DBT key, data;
+	MsgNumberList *list = NULL;
+	guint i;
 
 	g_return_val_if_fail(uiddb, NULL);
 
-	memset(&key, 0, sizeof(key));
-	memset(&data, 0, sizeof(data));
+	for (i = 0; i < uiddb->records->len; i++)
+		if (g_ptr_array_index(uiddb->records, i) != NULL)
+			list = g_slist_prepend(list, GUINT_TO_POINTER(uiddb->uidbase + i));
+
+	return list;
+}
+
+/* Views point into the records kept in memory, which stay unchanged
+ * until the next call that modifies the UIDDB */
+gboolean uiddb_view_entry_for_uid(UIDDB *uiddb, guint32 uid, MessageDataView *view)
+{
+	gpointer data;
+
+	g_return_val_if_fail(uiddb, FALSE);
 
-	key.size = sizeof(guint32);
-	key.data = &uid;
+	if ((data = get_record(uiddb, uid)) == NULL)
+		return FALSE;
 
-	if (uiddb->db_uid->get(uiddb->db_uid, NULL, &key, &data, 0) != 0)
+	unmarshal_view(data, view);
+	return TRUE;
+}
+
+gboolean uiddb_view_entry_for_uniq(UIDDB *uiddb, const gchar *uniq, MessageDataView *view)
+{
+	gpointer data;
+
+	g_return_val_if_fail(uiddb, FALSE);
+
+	if ((data = g_hash_table_lookup(uiddb->uniqs, uniq)) == NULL)
+		return FALSE;
+
+	unmarshal_view(data, view);
+	return TRUE;
+}
+
+MessageData *uiddb_get_entry_for_uid(UIDDB *uiddb, guint32 uid)
+{
+	MessageDataView view;
+
+	if (!uiddb_view_entry_for_uid(uiddb, uid, &view))
 		return NULL;
 
-	return unmarshal(data);
+	return uiddb_copy_msgdata(&view);
 }
 
-MessageData *uiddb_get_entry_for_uniq(UIDDB *uiddb, gchar *uniq)
+GSList *uiddb_get_entries_for_uids(UIDDB *uiddb, MsgNumberList *list)
 {
-	DBT key, pkey, data;
+	GSList *entries = NULL;
+	gpointer data;
 
 	g_return_val_if_fail(uiddb, NULL);
 
-	memset(&key, 0, sizeof(key));
-	memset(&pkey, 0, sizeof(pkey));
-	memset(&data, 0, sizeof(data));
+	for (; list != NULL; list = g_slist_next(list)) {
+		guint32 uid = GPOINTER_TO_INT(list->data);
+
+		if ((data = get_record(uiddb, uid)) != NULL)
+			entries = g_slist_prepend(entries, unmarshal(data));
+	}
 
-	key.size = strlen(uniq);
-	key.data = uniq;
+	return g_slist_reverse(entries);
+}
 
-	if (uiddb->db_uniq->pget(uiddb->db_uniq, NULL, &key, &pkey, &data, 0) != 0)
+MessageData *uiddb_get_entry_for_uniq(UIDDB *uiddb, gchar *uniq)
+{
+	MessageDataView view;
+
+	if (!uiddb_view_entry_for_uniq(uiddb, uniq, &view))
 		return NULL;
 
-	return unmarshal(data);
+	return uiddb_copy_msgdata(&view);
 }
 
 void uiddb_delete_entry(UIDDB *uiddb, guint32 uid)
 {
-	DBT key;
-
 	g_return_if_fail(uiddb);
 
-	memset(&key, 0, sizeof(key));
+	if (get_record(uiddb, uid) == NULL)
+		return;
 
-	key.size = sizeof(guint32);
-	key.data = &uid;
+	free_record(uiddb, uid);
+	mark_dirty(uiddb, uid);
+}
 
-	uiddb->db_uid->del(uiddb->db_uid, NULL, &key, 0);
+static void put_entry(UIDDB *uiddb, MessageData *msgdata)
+{
+	guint32 size;
+
+	size = marshal(msgdata, &uiddb->buf, &uiddb->buflen);
+	free_record(uiddb, msgdata->uid);
+	set_record(uiddb, msgdata->uid, g_memdup(uiddb->buf, size));
+	mark_dirty(uiddb, msgdata->uid);
+
+	if (msgdata->uid > uiddb->lastuid) {
+		uiddb->lastuid = msgdata->uid;
+		if (uiddb->lastuid > uiddb->uidlimit) {
+			uiddb->uidlimit = uiddb->lastuid;
+			uiddb->backend->put_meta(uiddb->store, META_LASTUID, uiddb->uidlimit);
+		}
+	}
 }
 
 void uiddb_insert_entry(UIDDB *uiddb, MessageData *msgdata)
 {
-	DBT key, data;
-	gint ret;
+	g_return_if_fail(uiddb);
+
+	put_entry(uiddb, msgdata);
+}
+
+void uiddb_insert_entries(UIDDB *uiddb, GSList *msgdata_list)
+{
+	GSList *cur;
 
 	g_return_if_fail(uiddb);
 
-	memset(&key, 0, sizeof(key));
-	memset(&data, 0, sizeof(data));
+	for (cur = msgdata_list; cur != NULL; cur = g_slist_next(cur))
+		put_entry(uiddb, (MessageData *) cur->data);
+}
+
+void uiddb_delete_entries_in_list(UIDDB *uiddb, MsgNumberList *list,
+				  UIDDBRemoveFunc func, gpointer data)
+{
+	gpointer record;
 
-	key.size = sizeof(guint32);
-	key.data = &msgdata->uid;
+	g_return_if_fail(uiddb);
+	g_return_if_fail(func);
 
-	data = marshal(msgdata);
+	for (; list != NULL; list = g_slist_next(list)) {
+		guint32 uid = GPOINTER_TO_INT(list->data);
+		MessageData *msgdata;
 
-	ret = uiddb->db_uid->put(uiddb->db_uid, NULL, &key, &data, 0);
-	if (ret != 0)
-		debug_print("DB->put: %s\n", db_strerror(ret));
+		if ((record = get_record(uiddb, uid)) == NULL)
+			continue;
 
-	g_free(data.data);
+		msgdata = unmarshal(record);
+		if (func(msgdata, data))
+			uiddb_delete_entry(uiddb, uid);
+		uiddb_free_msgdata(msgdata);
+	}
 }
 
-static int uiddb_uid_compare(const void *a, const void *b)
+void uiddb_delete_all_entries(UIDDB *uiddb)
 {
-    return *(guint32*)a - *(guint32*)b;
+	guint32 uid;
+
+	g_return_if_fail(uiddb);
+
+	for (uid = 0; uid < uiddb->records->len; uid++)
+		g_free(g_ptr_array_index(uiddb->records, uid));
+	g_ptr_array_set_size(uiddb->records, 0);
+	g_hash_table_remove_all(uiddb->uniqs);
+	g_hash_table_remove_all(uiddb->dirty);
+
+	uiddb->cleared = TRUE;
+	schedule_flush(uiddb);
+}
+
+static gint uid_compare(gconstpointer a, gconstpointer b)
+{
+	guint32 uid_a = *((const guint32 *) a);
+	guint32 uid_b = *((const guint32 *) b);
+
+	return (uid_a > uid_b) - (uid_a < uid_b);
 }
 
 void uiddb_delete_entries_not_in_list(UIDDB *uiddb, MsgNumberList *list)
 {
-	DBC *cursor;
-	DBT key, data;
-	gint i, uidcnt, ret;
-	guint32 *uid_sorted;
+	guint32 *uid_sorted, uid;
+	gint i, uidcnt;
 
 	g_return_if_fail(uiddb);
 	if (list == NULL)
 		return;
 
-	ret = uiddb->db_uid->cursor(uiddb->db_uid, NULL, &cursor, DB_WRITECURSOR);
-	if (ret != 0) {
-		debug_print("DB->cursor: %s\n", db_strerror(ret));
-		return;
-	}
-
 	uidcnt = g_slist_length(list);
 	uid_sorted = g_new(guint32, uidcnt);
 	for (i = 0; i < uidcnt; i++) {
 	    uid_sorted[i] = GPOINTER_TO_INT(list->data);
 	    list = g_slist_next(list);
 	}
-	
-	memset(&key, 0, sizeof(key));
-	memset(&data, 0, sizeof(data));
-	while ((ret = cursor->c_get(cursor, &key, &data, DB_NEXT)) == 0) {
-		guint32 uid = *((guint32 *) key.data);
+	qsort(uid_sorted, uidcnt, sizeof(guint32), uid_compare);
+
+	/* the records are indexed in UID order too: one merge pass finds
+	 * all stale records */
+	i = 0;
+	for (uid = uiddb->uidbase; uid - uiddb->uidbase < uiddb->records->len; uid++) {
+		if (get_record(uiddb, uid) == NULL)
+			continue;
+
+		while (i < uidcnt && uid_sorted[i] < uid)
+			i++;
+		if (i >= uidcnt || uid_sorted[i] != uid)
+			uiddb_delete_entry(uiddb, uid);
+	}
+	trim_records(uiddb);
+
+	g_free(uid_sorted);
+}
+
+struct ConvertData
+{
+	UIDDBBackend	*backend;
+	UIDDBStore	*store;
+	gint		 count;
+	gboolean	 failed;
+};
+
+static void convert_record(guint32 uid, const void *data, guint32 size,
+			   gpointer userdata)
+{
+	struct ConvertData *convert = userdata;
+
+	if (convert->backend->put(convert->store, uid, data, size))
+		convert->count++;
+	else
+		convert->failed = TRUE;
+}
+
+/* Copies all records and the meta data of a database to a new one of
+ * another backend and removes the old database on success */
+gint uiddb_convert(UIDDBBackendType from, const gchar *fromfile,
+		   UIDDBBackendType to, const gchar *tofile)
+{
+	UIDDB *src;
+	struct ConvertData convert;
 
-		if (bsearch(&uid, uid_sorted, uidcnt, sizeof(guint32), &uiddb_uid_compare) == NULL)
-			cursor->c_del(cursor, 0);
+	g_return_val_if_fail(uiddb_backend_available(from), -1);
+	g_return_val_if_fail(uiddb_backend_available(to), -1);
+	g_return_val_if_fail(from != to, -1);
 
-		memset(&key, 0, sizeof(key));
-		memset(&data, 0, sizeof(data));
+	/* opening also brings old databases to the current version */
+	if ((src = uiddb_open(from, fromfile)) == NULL)
+		return -1;
+
+	convert.backend = backends[to];
+	if ((convert.store = convert.backend->open(tofile)) == NULL) {
+		uiddb_close(src);
+		return -1;
+	}
+	convert.count = 0;
+	convert.failed = FALSE;
+
+	convert.backend->begin(convert.store);
+	convert.backend->clear(convert.store);
+	src->backend->foreach(src->store, convert_record, &convert);
+	convert.backend->put_meta(convert.store, META_LASTUID, src->lastuid);
+	convert.backend->put_meta(convert.store, META_UIDVALIDITY, src->uidvalidity);
+	if (!convert.backend->end(convert.store))
+		convert.failed = TRUE;
+
+	convert.backend->close(convert.store);
+	uiddb_close(src);
+
+	if (convert.failed) {
+		g_warning("converting %s to %s failed\n", fromfile, tofile);
+		backends[to]->remove(tofile);
+		return -1;
 	}
 
-	g_free(uid_sorted);
+	debug_print("converted %d records from %s to %s\n", convert.count,
+		    uiddb_backend_get_name(from), uiddb_backend_get_name(to));
+	backends[from]->remove(fromfile);
 
-	cursor->c_close(cursor);
+	return 0;
 }
@@ -24,6 +24,15 @@
 
 typedef struct _UIDDB UIDDB;
 typedef struct _MessageData MessageData;
+typedef struct _MessageDataView MessageDataView;
+typedef gboolean (*UIDDBRemoveFunc) (MessageData *, gpointer);
+
+typedef enum
+{
+	UIDDB_BACKEND_BDB,
+	UIDDB_BACKEND_LMDB,
+	UIDDB_BACKEND_COUNT
+} UIDDBBackendType;
 
 #include "procmsg.h"
 
@@ -35,19 +44,64 @@ struct _MessageData
 	gchar	*dir;
 };
 
+/* Flags from the info part of a file name, as stored in the database */
+#define MAILDIR_INFO_DRAFT	(1 << 0)
+#define MAILDIR_INFO_FLAGGED	(1 << 1)
+#define MAILDIR_INFO_PASSED	(1 << 2)
+#define MAILDIR_INFO_REPLIED	(1 << 3)
+#define MAILDIR_INFO_SEEN	(1 << 4)
+#define MAILDIR_INFO_TRASHED	(1 << 5)
+#define MAILDIR_INFO_V2		(1 << 7)	/* info starts with "2," */
+
+/* Read-only record that points into memory owned by the UIDDB handle.
+ * It is only valid until the next call on the handle. raw holds the
+ * info part only if flags can not describe it, otherwise it is empty. */
+struct _MessageDataView
+{
+	guint32		 uid;
+	const gchar	*uniq;
+	const gchar	*dir;
+	guint8		 flags;
+	const gchar	*raw;
+};
+
 void uiddb_init();
 void uiddb_done();
 
 void uiddb_free_msgdata(MessageData *);
+MessageData *uiddb_copy_msgdata(const MessageDataView *);
+gchar *uiddb_view_get_info(const MessageDataView *);
+gboolean uiddb_view_info_equal(const MessageDataView *, const gchar *);
+
+gboolean uiddb_backend_available(UIDDBBackendType);
+UIDDBBackendType uiddb_backend_from_name(const gchar *);
+const gchar *uiddb_backend_get_name(UIDDBBackendType);
+const gchar *uiddb_backend_get_filename(UIDDBBackendType);
+UIDDBBackendType uiddb_backend_get_default(void);
+gint uiddb_convert(UIDDBBackendType, const gchar *, UIDDBBackendType, const gchar *);
 
-UIDDB *uiddb_open(const gchar *);
+UIDDB *uiddb_open(UIDDBBackendType, const gchar *);
 void uiddb_close(UIDDB *);
+void uiddb_flush(UIDDB *);
+gboolean uiddb_take_changed(UIDDB *);
 guint32 uiddb_get_new_uid(UIDDB *);
+guint32 uiddb_reserve_uids(UIDDB *, guint);
+guint32 uiddb_get_uidvalidity(UIDDB *);
+void uiddb_set_uidvalidity(UIDDB *, guint32);
+void uiddb_raise_last_uid(UIDDB *, guint32);
 
+MsgNumberList *uiddb_get_uids(UIDDB *);
+gboolean uiddb_view_entry_for_uid(UIDDB *, guint32, MessageDataView *);
+gboolean uiddb_view_entry_for_uniq(UIDDB *, const gchar *, MessageDataView *);
 MessageData *uiddb_get_entry_for_uid(UIDDB *, guint32);
 MessageData *uiddb_get_entry_for_uniq(UIDDB *uiddb, gchar *);
+GSList *uiddb_get_entries_for_uids(UIDDB *uiddb, MsgNumberList *list);
 void uiddb_delete_entry(UIDDB *, guint32);
 void uiddb_insert_entry(UIDDB *, MessageData *);
+void uiddb_insert_entries(UIDDB *, GSList *);
 void uiddb_delete_entries_not_in_list(UIDDB *uiddb, MsgNumberList *list);
+void uiddb_delete_entries_in_list(UIDDB *uiddb, MsgNumberList *list,
+				  UIDDBRemoveFunc func, gpointer data);
+void uiddb_delete_all_entries(UIDDB *uiddb);
 
 #endif /* UIDDB_H */
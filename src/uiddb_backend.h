@@ -0,0 +1,88 @@
+/*
+ * Maildir Plugin -- Maildir++ support for Sylpheed
+ * Copyright (C) 2003 Christoph Hohmann
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef UIDDB_BACKEND_H
+#define UIDDB_BACKEND_H 1
+
+#include <glib.h>
+
+#include "uiddb.h"
+
+/*
+ * Interface between the uiddb_* API and the storage engines. Backends
+ * store opaque records under a guint32 UID key, lookups by uniq are
+ * served from memory. The records are loaded with foreach when a
+ * database is opened and written back in groups.
+ */
+
+typedef struct _UIDDBStore UIDDBStore;
+typedef struct _UIDDBBackend UIDDBBackend;
+
+/* Called for every record by foreach, data belongs to the backend */
+typedef void (*UIDDBRecordFunc) (guint32 uid, const void *data, guint32 size,
+				 gpointer userdata);
+
+struct _UIDDBBackend
+{
+	const gchar	*name;
+
+	gboolean	 (*init)	(void);
+	void		 (*done)	(void);
+
+	UIDDBStore	*(*open)	(const gchar *file);
+	void		 (*close)	(UIDDBStore *store);
+	void		 (*remove)	(const gchar *file);
+
+	gboolean	 (*get_meta)	(UIDDBStore *store, const gchar *name,
+					 guint32 *value);
+	void		 (*put_meta)	(UIDDBStore *store, const gchar *name,
+					 guint32 value);
+
+	gboolean	 (*put)		(UIDDBStore *store, guint32 uid,
+					 const void *data, guint32 size);
+	void		 (*del)		(UIDDBStore *store, guint32 uid);
+	void		 (*del_uids)	(UIDDBStore *store, const guint32 *uids,
+					 guint count);
+	void		 (*clear)	(UIDDBStore *store);
+	void		 (*foreach)	(UIDDBStore *store, UIDDBRecordFunc func,
+					 gpointer userdata);
+
+	/* groups the writes until the matching end in one lock or
+	 * transaction, calls may nest. end returns whether the group
+	 * was committed. */
+	void		 (*begin)	(UIDDBStore *store);
+	gboolean	 (*end)		(UIDDBStore *store);
+};
+
+/* Record layout (version 2):
+ *   guint32 uid, guint8 dir index, guint8 info flags,
+ *   uniq + NUL, raw info + NUL (empty unless the flags are not enough)
+ */
+#define RECORD_VERSION		2
+#define RECORD_HEADER_SIZE	(sizeof(guint32) + 2)
+#define RECORD_UNIQ(data)	((const gchar *) (data) + RECORD_HEADER_SIZE)
+
+guint32 uiddb_record_from_v1(const void *data, gpointer *buf, guint32 *buflen);
+
+extern UIDDBBackend uiddb_bdb_backend;
+#ifdef HAVE_LMDB
+extern UIDDBBackend uiddb_lmdb_backend;
+#endif
+
+#endif /* UIDDB_BACKEND_H */
@@ -0,0 +1,429 @@
+/*
+ * Maildir Plugin -- Maildir++ support for Sylpheed
+ * Copyright (C) 2003-2004 Christoph Hohmann
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <glib.h>
+#include <db.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "uiddb_backend.h"
+
+struct _UIDDBStore
+{
+	DB	*db_uid;
+	DB	*db_meta;
+	DB_TXN	*txn;		/* CDB group of the outermost begin */
+	guint	 nesting;
+};
+
+#define META_VERSION		"version"
+
+#define BULK_BUFFER_SIZE	(64 * 1024)
+
+static DB_ENV *dbenv;
+
+static gboolean bdb_init(void)
+{
+	gint ret;
+
+	if ((ret = db_env_create(&dbenv, 0)) != 0) {
+		debug_print("db_env_create: %s\n", db_strerror(ret));
+		return FALSE;
+	}
+	if ((ret = dbenv->open(dbenv, get_tmp_dir(), DB_INIT_MPOOL | DB_INIT_CDB | DB_CREATE, 0600)) != 0) {
+		debug_print("DB_ENV->open: %s\n", db_strerror(ret));
+		dbenv->close(dbenv, 0);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void bdb_done(void)
+{
+	dbenv->close(dbenv, 0);
+}
+
+static gboolean bdb_get_meta(UIDDBStore *store, const gchar *name, guint32 *value)
+{
+	DBT key, data;
+
+	memset(&key, 0, sizeof(key));
+	memset(&data, 0, sizeof(data));
+
+	key.size = strlen(name);
+	key.data = (gchar *) name;
+
+	if (store->db_meta->get(store->db_meta, store->txn, &key, &data, 0) != 0)
+		return FALSE;
+	if (data.size != sizeof(guint32))
+		return FALSE;
+
+	memcpy(value, data.data, sizeof(guint32));
+	return TRUE;
+}
+
+static void bdb_put_meta(UIDDBStore *store, const gchar *name, guint32 value)
+{
+	DBT key, data;
+	gint ret;
+
+	memset(&key, 0, sizeof(key));
+	memset(&data, 0, sizeof(data));
+
+	key.size = strlen(name);
+	key.data = (gchar *) name;
+	data.size = sizeof(guint32);
+	data.data = &value;
+
+	if ((ret = store->db_meta->put(store->db_meta, store->txn, &key, &data, 0)) != 0)
+		debug_print("DB->put: %s\n", db_strerror(ret));
+}
+
+/* Rewrites records of the first version (uid, then uniq, info and dir
+ * as strings) in place */
+static gint migrate_records(UIDDBStore *store)
+{
+	DBC *cursor;
+	DBT key, data, newdata;
+	gpointer buf = NULL;
+	guint32 buflen = 0;
+	gint ret, count = 0;
+
+	ret = store->db_uid->cursor(store->db_uid, NULL, &cursor, DB_WRITECURSOR);
+	if (ret != 0) {
+		debug_print("DB->cursor: %s\n", db_strerror(ret));
+		return -1;
+	}
+
+	memset(&key, 0, sizeof(key));
+	memset(&data, 0, sizeof(data));
+	memset(&newdata, 0, sizeof(newdata));
+	while ((ret = cursor->c_get(cursor, &key, &data, DB_NEXT)) == 0) {
+		/* the new record is built in buf, the old one stays untouched
+		 * until c_put */
+		newdata.size = uiddb_record_from_v1(data.data, &buf, &buflen);
+		newdata.data = buf;
+		if ((ret = cursor->c_put(cursor, &key, &newdata, DB_CURRENT)) != 0) {
+			debug_print("DBC->c_put: %s\n", db_strerror(ret));
+			break;
+		}
+		count++;
+
+		memset(&key, 0, sizeof(key));
+		memset(&data, 0, sizeof(data));
+	}
+
+	cursor->c_close(cursor);
+	g_free(buf);
+
+	debug_print("migrated %d records to version %d\n", count, RECORD_VERSION);
+	return ret == DB_NOTFOUND ? 0 : -1;
+}
+
+static void bdb_close(UIDDBStore *store)
+{
+	g_return_if_fail(store != NULL);
+
+	if (store->db_uid != NULL)
+		store->db_uid->close(store->db_uid, 0);
+	if (store->db_meta != NULL)
+		store->db_meta->close(store->db_meta, 0);
+
+	g_free(store);
+}
+
+static UIDDBStore *bdb_open(const gchar *dbfile)
+{
+	gint	 ret;
+	DB	*db_uid, *db_meta;
+	UIDDBStore *store;
+	guint32	 version;
+
+	/* open uid key based database */
+	if ((ret = db_create(&db_uid, dbenv, 0)) != 0) {
+		debug_print("db_create: %s\n", db_strerror(ret));
+		return NULL;
+	}
+	if ((ret = db_uid->open(db_uid, NULL, dbfile, "uidkey", DB_BTREE, DB_CREATE, 0600)) != 0) {
+		debug_print("DB->open: %s\n", db_strerror(ret));
+		db_uid->close(db_uid, 0);
+		return NULL;
+	}
+	debug_print("UID based database opened\n");
+
+	/* open database for the last UID, the UIDVALIDITY and the version */
+	if ((ret = db_create(&db_meta, dbenv, 0)) != 0) {
+		debug_print("db_create: %s\n", db_strerror(ret));
+		db_uid->close(db_uid, 0);
+		return NULL;
+	}
+	if ((ret = db_meta->open(db_meta, NULL, dbfile, "meta", DB_BTREE, DB_CREATE, 0600)) != 0) {
+		debug_print("DB->open: %s\n", db_strerror(ret));
+		db_meta->close(db_meta, 0);
+		db_uid->close(db_uid, 0);
+		return NULL;
+	}
+	debug_print("Meta database opened\n");
+
+	store = g_new0(UIDDBStore, 1);
+	store->db_uid = db_uid;
+	store->db_meta = db_meta;
+
+	if (!bdb_get_meta(store, META_VERSION, &version))
+		version = 1;
+	if (version > RECORD_VERSION) {
+		g_warning("%s: unsupported database version %d\n", dbfile, version);
+		bdb_close(store);
+		return NULL;
+	}
+	if (version < RECORD_VERSION) {
+		if (migrate_records(store) < 0) {
+			bdb_close(store);
+			return NULL;
+		}
+		bdb_put_meta(store, META_VERSION, RECORD_VERSION);
+		/* records are only looked up by uniq in memory, the index
+		 * of the first version is not needed any more */
+		if ((ret = dbenv->dbremove(dbenv, NULL, dbfile, "uniqkey", 0)) != 0 &&
+		    ret != ENOENT)
+			debug_print("DB_ENV->dbremove: %s\n", db_strerror(ret));
+	}
+
+	return store;
+}
+
+static void bdb_remove(const gchar *dbfile)
+{
+	if (unlink(dbfile) < 0)
+		FILE_OP_ERROR(dbfile, "unlink");
+}
+
+static gboolean bdb_put(UIDDBStore *store, guint32 uid, const void *buf, guint32 size)
+{
+	DBT key, data;
+	gint ret;
+
+	memset(&key, 0, sizeof(key));
+	memset(&data, 0, sizeof(data));
+
+	key.size = sizeof(guint32);
+	key.data = &uid;
+	data.size = size;
+	data.data = (void *) buf;
+
+	ret = store->db_uid->put(store->db_uid, store->txn, &key, &data, 0);
+	if (ret != 0) {
+		debug_print("DB->put: %s\n", db_strerror(ret));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void bdb_del(UIDDBStore *store, guint32 uid)
+{
+	DBT key;
+
+	memset(&key, 0, sizeof(key));
+
+	key.size = sizeof(guint32);
+	key.data = &uid;
+
+	store->db_uid->del(store->db_uid, store->txn, &key, 0);
+}
+
+static void bdb_del_uids(UIDDBStore *store, const guint32 *uids, guint count)
+{
+	gint i;
+
+	if (count == 0)
+		return;
+
+#if DB_VERSION_MAJOR > 4 || (DB_VERSION_MAJOR == 4 && DB_VERSION_MINOR >= 8)
+	{
+		DBT key;
+		void *ptr;
+		gint ret;
+
+		memset(&key, 0, sizeof(key));
+		key.ulen = count * 4 * sizeof(guint32) + 1024;
+		key.data = g_malloc(key.ulen);
+		key.flags = DB_DBT_USERMEM | DB_DBT_BULK;
+
+		DB_MULTIPLE_WRITE_INIT(ptr, &key);
+		for (i = 0; i < count; i++)
+			DB_MULTIPLE_WRITE_NEXT(ptr, &key, (void *) &uids[i],
+					       sizeof(guint32));
+
+		ret = store->db_uid->del(store->db_uid, store->txn, &key, DB_MULTIPLE);
+		g_free(key.data);
+		if (ret == 0)
+			return;
+		debug_print("DB->del: %s\n", db_strerror(ret));
+	}
+#endif
+
+	for (i = 0; i < count; i++)
+		bdb_del(store, uids[i]);
+}
+
+static void bdb_clear(UIDDBStore *store)
+{
+	DBC *cursor;
+	DBT key, data;
+	u_int32_t count;
+	gint ret;
+
+	if ((ret = store->db_uid->truncate(store->db_uid, store->txn, &count, 0)) == 0)
+		return;
+	debug_print("DB->truncate: %s\n", db_strerror(ret));
+
+	/* sweep the whole database with one cursor instead */
+	ret = store->db_uid->cursor(store->db_uid, store->txn, &cursor, DB_WRITECURSOR);
+	if (ret != 0) {
+		debug_print("DB->cursor: %s\n", db_strerror(ret));
+		return;
+	}
+
+	memset(&key, 0, sizeof(key));
+	memset(&data, 0, sizeof(data));
+	while ((ret = cursor->c_get(cursor, &key, &data, DB_NEXT)) == 0) {
+		cursor->c_del(cursor, 0);
+
+		memset(&key, 0, sizeof(key));
+		memset(&data, 0, sizeof(data));
+	}
+
+	cursor->c_close(cursor);
+}
+
+/* CDB doesn't allow writes while this thread holds a read cursor, so
+ * func must not write to the store */
+static void bdb_foreach(UIDDBStore *store, UIDDBRecordFunc func, gpointer userdata)
+{
+	DBC *cursor;
+	DBT key, data;
+	gint ret;
+
+	ret = store->db_uid->cursor(store->db_uid, store->txn, &cursor, 0);
+	if (ret != 0) {
+		debug_print("DB->cursor: %s\n", db_strerror(ret));
+		return;
+	}
+
+	memset(&key, 0, sizeof(key));
+	memset(&data, 0, sizeof(data));
+#ifdef DB_MULTIPLE_KEY
+	data.ulen = BULK_BUFFER_SIZE;
+	data.data = g_malloc(data.ulen);
+	data.flags = DB_DBT_USERMEM;
+
+	while ((ret = cursor->c_get(cursor, &key, &data, DB_NEXT | DB_MULTIPLE_KEY)) == 0) {
+		void *ptr, *retkey, *retdata;
+		u_int32_t retklen, retdlen;
+		guint32 uid;
+
+		DB_MULTIPLE_INIT(ptr, &data);
+		for (;;) {
+			DB_MULTIPLE_KEY_NEXT(ptr, &data, retkey, retklen, retdata, retdlen);
+			if (ptr == NULL)
+				break;
+			memcpy(&uid, retkey, sizeof(uid));
+			func(uid, retdata, retdlen, userdata);
+		}
+	}
+
+	g_free(data.data);
+#else
+	while ((ret = cursor->c_get(cursor, &key, &data, DB_NEXT)) == 0) {
+		guint32 uid;
+
+		memcpy(&uid, key.data, sizeof(uid));
+		func(uid, data.data, data.size, userdata);
+
+		memset(&key, 0, sizeof(key));
+		memset(&data, 0, sizeof(data));
+	}
+#endif
+
+	cursor->c_close(cursor);
+}
+
+static void bdb_begin(UIDDBStore *store)
+{
+	if (store->nesting++ > 0)
+		return;
+
+#if DB_VERSION_MAJOR > 4 || (DB_VERSION_MAJOR == 4 && DB_VERSION_MINOR >= 5)
+	/* take the CDB write lock once for the whole group */
+	{
+		gint ret;
+
+		if ((ret = dbenv->cdsgroup_begin(dbenv, &store->txn)) != 0) {
+			debug_print("DB_ENV->cdsgroup_begin: %s\n", db_strerror(ret));
+			store->txn = NULL;
+		}
+	}
+#endif
+}
+
+static gboolean bdb_end(UIDDBStore *store)
+{
+	gint ret = 0;
+
+	g_return_val_if_fail(store->nesting > 0, FALSE);
+
+	if (--store->nesting > 0)
+		return TRUE;
+
+	if (store->txn != NULL) {
+		if ((ret = store->txn->commit(store->txn, 0)) != 0)
+			debug_print("DB_TXN->commit: %s\n", db_strerror(ret));
+		store->txn = NULL;
+	}
+
+	return ret == 0;
+}
+
+UIDDBBackend uiddb_bdb_backend =
+{
+	"bdb",
+
+	bdb_init,
+	bdb_done,
+
+	bdb_open,
+	bdb_close,
+	bdb_remove,
+
+	bdb_get_meta,
+	bdb_put_meta,
+
+	bdb_put,
+	bdb_del,
+	bdb_del_uids,
+	bdb_clear,
+	bdb_foreach,
+
+	bdb_begin,
+	bdb_end,
+};
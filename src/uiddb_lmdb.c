@@ -0,0 +1,392 @@
+/*
+ * Maildir Plugin -- Maildir++ support for Sylpheed
+ * Copyright (C) 2003-2004 Christoph Hohmann
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include "pluginconfig.h"
+
+#ifdef HAVE_LMDB
+
+#include <glib.h>
+#include <lmdb.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "uiddb_backend.h"
+
+/*
+ * Every database is its own LMDB environment in a single file, so
+ * writers of different folders never wait for each other. Reads go
+ * through one read-only transaction per store that is renewed for every
+ * call; foreach hands out the records directly from the memory map.
+ */
+
+struct _UIDDBStore
+{
+	MDB_env		*env;
+	MDB_dbi		 dbi_uid;
+	MDB_dbi		 dbi_meta;
+	MDB_txn		*rtxn;		/* reset while no read is in progress */
+	gboolean	 rtxn_active;
+	MDB_txn		*wtxn;		/* write transaction of the outermost begin */
+	guint		 nesting;
+	gboolean	 failed;	/* an operation inside wtxn failed */
+};
+
+/* Only address space is reserved, the file grows with the data */
+#define LMDB_MAP_SIZE	(sizeof(gpointer) > 4 ? 1024 * 1024 * 1024 : 128 * 1024 * 1024)
+
+static gboolean lmdb_init(void)
+{
+	return TRUE;
+}
+
+static void lmdb_done(void)
+{
+}
+
+static void lmdb_close(UIDDBStore *store)
+{
+	g_return_if_fail(store != NULL);
+
+	if (store->wtxn != NULL)
+		mdb_txn_abort(store->wtxn);
+	if (store->rtxn != NULL)
+		mdb_txn_abort(store->rtxn);
+	mdb_env_close(store->env);
+
+	g_free(store);
+}
+
+static UIDDBStore *lmdb_open(const gchar *dbfile)
+{
+	UIDDBStore *store;
+	MDB_txn *txn;
+	MDB_dbi dbi_uniq;
+	gint ret;
+
+	store = g_new0(UIDDBStore, 1);
+
+	if ((ret = mdb_env_create(&store->env)) != 0) {
+		debug_print("mdb_env_create: %s\n", mdb_strerror(ret));
+		g_free(store);
+		return NULL;
+	}
+	mdb_env_set_maxdbs(store->env, 3);
+	mdb_env_set_mapsize(store->env, LMDB_MAP_SIZE);
+
+	/* MDB_NOTLS allows the read transaction to stay allocated while
+	 * this thread writes */
+	if ((ret = mdb_env_open(store->env, dbfile, MDB_NOSUBDIR | MDB_NOTLS, 0600)) != 0) {
+		debug_print("mdb_env_open: %s\n", mdb_strerror(ret));
+		lmdb_close(store);
+		return NULL;
+	}
+
+	if ((ret = mdb_txn_begin(store->env, NULL, 0, &txn)) != 0) {
+		debug_print("mdb_txn_begin: %s\n", mdb_strerror(ret));
+		lmdb_close(store);
+		return NULL;
+	}
+	if ((ret = mdb_dbi_open(txn, "uidkey", MDB_CREATE | MDB_INTEGERKEY, &store->dbi_uid)) != 0 ||
+	    (ret = mdb_dbi_open(txn, "meta", MDB_CREATE, &store->dbi_meta)) != 0) {
+		debug_print("mdb_dbi_open: %s\n", mdb_strerror(ret));
+		mdb_txn_abort(txn);
+		lmdb_close(store);
+		return NULL;
+	}
+	/* records are only looked up by uniq in memory, drop the index
+	 * earlier versions kept */
+	if (mdb_dbi_open(txn, "uniqkey", 0, &dbi_uniq) == 0 &&
+	    (ret = mdb_drop(txn, dbi_uniq, 1)) != 0) {
+		debug_print("mdb_drop: %s\n", mdb_strerror(ret));
+		mdb_txn_abort(txn);
+		lmdb_close(store);
+		return NULL;
+	}
+	/* a failed commit frees the transaction itself */
+	if ((ret = mdb_txn_commit(txn)) != 0) {
+		debug_print("mdb_txn_commit: %s\n", mdb_strerror(ret));
+		lmdb_close(store);
+		return NULL;
+	}
+	debug_print("LMDB database opened\n");
+
+	if ((ret = mdb_txn_begin(store->env, NULL, MDB_RDONLY, &store->rtxn)) != 0) {
+		debug_print("mdb_txn_begin: %s\n", mdb_strerror(ret));
+		lmdb_close(store);
+		return NULL;
+	}
+	mdb_txn_reset(store->rtxn);
+
+	return store;
+}
+
+static void lmdb_remove(const gchar *dbfile)
+{
+	gchar *lockfile;
+
+	if (unlink(dbfile) < 0)
+		FILE_OP_ERROR(dbfile, "unlink");
+
+	lockfile = g_strconcat(dbfile, "-lock", NULL);
+	unlink(lockfile);
+	g_free(lockfile);
+}
+
+/* Returns the transaction to read from, with a fresh snapshot unless
+ * a write transaction is open */
+static MDB_txn *read_txn(UIDDBStore *store)
+{
+	gint ret;
+
+	if (store->wtxn != NULL)
+		return store->wtxn;
+
+	if (store->rtxn_active)
+		mdb_txn_reset(store->rtxn);
+	if ((ret = mdb_txn_renew(store->rtxn)) != 0) {
+		debug_print("mdb_txn_renew: %s\n", mdb_strerror(ret));
+		store->rtxn_active = FALSE;
+		return NULL;
+	}
+	store->rtxn_active = TRUE;
+
+	return store->rtxn;
+}
+
+static void release_read_txn(UIDDBStore *store)
+{
+	if (store->rtxn_active) {
+		mdb_txn_reset(store->rtxn);
+		store->rtxn_active = FALSE;
+	}
+}
+
+static void lmdb_begin(UIDDBStore *store)
+{
+	gint ret;
+
+	if (store->nesting++ > 0)
+		return;
+
+	/* records returned before are invalid from here on anyway */
+	release_read_txn(store);
+
+	store->failed = FALSE;
+	if ((ret = mdb_txn_begin(store->env, NULL, 0, &store->wtxn)) != 0) {
+		debug_print("mdb_txn_begin: %s\n", mdb_strerror(ret));
+		store->wtxn = NULL;
+		store->failed = TRUE;
+	}
+}
+
+static gboolean lmdb_end(UIDDBStore *store)
+{
+	gint ret;
+
+	g_return_val_if_fail(store->nesting > 0, FALSE);
+
+	if (--store->nesting > 0)
+		return TRUE;
+
+	if (store->wtxn == NULL)
+		return FALSE;
+
+	if (store->failed) {
+		mdb_txn_abort(store->wtxn);
+		store->wtxn = NULL;
+		return FALSE;
+	}
+
+	ret = mdb_txn_commit(store->wtxn);
+	store->wtxn = NULL;
+	if (ret != 0) {
+		debug_print("mdb_txn_commit: %s\n", mdb_strerror(ret));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Single writes outside of begin/end get a transaction of their own */
+static MDB_txn *write_txn(UIDDBStore *store)
+{
+	lmdb_begin(store);
+
+	return store->wtxn;
+}
+
+static gboolean check_write(UIDDBStore *store, gint ret, const gchar *op)
+{
+	if (ret != 0 && ret != MDB_NOTFOUND) {
+		debug_print("%s: %s\n", op, mdb_strerror(ret));
+		store->failed = TRUE;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean lmdb_get_meta(UIDDBStore *store, const gchar *name, guint32 *value)
+{
+	MDB_txn *txn;
+	MDB_val key, data;
+
+	if ((txn = read_txn(store)) == NULL)
+		return FALSE;
+
+	key.mv_size = strlen(name);
+	key.mv_data = (gchar *) name;
+
+	if (mdb_get(txn, store->dbi_meta, &key, &data) != 0)
+		return FALSE;
+	if (data.mv_size != sizeof(guint32))
+		return FALSE;
+
+	memcpy(value, data.mv_data, sizeof(guint32));
+	return TRUE;
+}
+
+static void lmdb_put_meta(UIDDBStore *store, const gchar *name, guint32 value)
+{
+	MDB_txn *txn;
+	MDB_val key, data;
+
+	if ((txn = write_txn(store)) != NULL) {
+		key.mv_size = strlen(name);
+		key.mv_data = (gchar *) name;
+		data.mv_size = sizeof(guint32);
+		data.mv_data = &value;
+
+		check_write(store, mdb_put(txn, store->dbi_meta, &key, &data, 0), "mdb_put");
+	}
+	lmdb_end(store);
+}
+
+static gboolean lmdb_put(UIDDBStore *store, guint32 uid, const void *buf, guint32 size)
+{
+	MDB_txn *txn;
+	MDB_val key, data;
+	gboolean ok = FALSE;
+
+	if ((txn = write_txn(store)) != NULL) {
+		key.mv_size = sizeof(guint32);
+		key.mv_data = &uid;
+		data.mv_size = size;
+		data.mv_data = (void *) buf;
+
+		ok = check_write(store, mdb_put(txn, store->dbi_uid, &key, &data, 0), "mdb_put");
+	}
+
+	return lmdb_end(store) && ok;
+}
+
+static void del_record(UIDDBStore *store, MDB_txn *txn, guint32 uid)
+{
+	MDB_val key;
+
+	key.mv_size = sizeof(guint32);
+	key.mv_data = &uid;
+
+	check_write(store, mdb_del(txn, store->dbi_uid, &key, NULL), "mdb_del");
+}
+
+static void lmdb_del(UIDDBStore *store, guint32 uid)
+{
+	MDB_txn *txn;
+
+	if ((txn = write_txn(store)) != NULL)
+		del_record(store, txn, uid);
+	lmdb_end(store);
+}
+
+static void lmdb_del_uids(UIDDBStore *store, const guint32 *uids, guint count)
+{
+	MDB_txn *txn;
+	guint i;
+
+	/* don't commit a transaction for nothing */
+	if (count == 0)
+		return;
+
+	if ((txn = write_txn(store)) != NULL)
+		for (i = 0; i < count; i++)
+			del_record(store, txn, uids[i]);
+	lmdb_end(store);
+}
+
+static void lmdb_clear(UIDDBStore *store)
+{
+	MDB_txn *txn;
+
+	if ((txn = write_txn(store)) != NULL)
+		check_write(store, mdb_drop(txn, store->dbi_uid, 0), "mdb_drop");
+	lmdb_end(store);
+}
+
+static void lmdb_foreach(UIDDBStore *store, UIDDBRecordFunc func, gpointer userdata)
+{
+	MDB_txn *txn;
+	MDB_cursor *cursor;
+	MDB_val key, data;
+	gint ret;
+
+	if ((txn = read_txn(store)) == NULL)
+		return;
+
+	if ((ret = mdb_cursor_open(txn, store->dbi_uid, &cursor)) != 0) {
+		debug_print("mdb_cursor_open: %s\n", mdb_strerror(ret));
+		return;
+	}
+
+	while (mdb_cursor_get(cursor, &key, &data, MDB_NEXT) == 0) {
+		guint32 uid;
+
+		memcpy(&uid, key.mv_data, sizeof(uid));
+		func(uid, data.mv_data, data.mv_size, userdata);
+	}
+
+	mdb_cursor_close(cursor);
+}
+
+UIDDBBackend uiddb_lmdb_backend =
+{
+	"lmdb",
+
+	lmdb_init,
+	lmdb_done,
+
+	lmdb_open,
+	lmdb_close,
+	lmdb_remove,
+
+	lmdb_get_meta,
+	lmdb_put_meta,
+
+	lmdb_put,
+	lmdb_del,
+	lmdb_del_uids,
+	lmdb_clear,
+	lmdb_foreach,
+
+	lmdb_begin,
+	lmdb_end,
+};
+
+#endif /* HAVE_LMDB */
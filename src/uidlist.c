@@ -0,0 +1,430 @@
+/*
+ * Maildir Plugin -- Maildir++ support for Sylpheed
+ * Copyright (C) 2003-2004 Christoph Hohmann
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+
+#include "pluginconfig.h"
+
+#include <glib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "uidlist.h"
+
+/*
+ * IMAP servers keep the UIDs of a Maildir in a file next to cur/ and
+ * new/. The first line holds the version, the UIDVALIDITY and the next
+ * UID, the other lines map UIDs to file names:
+ *
+ * dovecot-uidlist
+ *   version 1:  "1 <uidvalidity> <nextuid>"       "<uid> <filename>"
+ *   version 3:  "3 V<uidvalidity> N<nextuid> ..." "<uid> [ext ...] :<filename>"
+ *
+ * courierimapuiddb
+ *   version 1/2: "<v> <uidvalidity> <nextuid>"    "<filename> <uid>" or
+ *                                                 "<uid> <filename>"
+ *
+ * Writers of dovecot-uidlist create dovecot-uidlist.lock exclusively,
+ * write the new list into it and rename it over dovecot-uidlist.
+ * Courier's list is only read.
+ */
+
+#define DOVECOT_UIDLIST_LOCK	DOVECOT_UIDLIST ".lock"
+#define LOCK_STALE_TIMEOUT	120	/* seconds until a lock is considered stale */
+#define LOCK_TRIES		50
+#define LOCK_RETRY_DELAY	100000	/* microseconds between tries */
+
+struct _UidList
+{
+	UidListType	 type;
+	guint		 version;
+	guint32		 uidvalidity;
+	guint32		 nextuid;
+	GHashTable	*uids;		/* uniq -> UID */
+
+	/* the file the list was read from */
+	dev_t		 dev;
+	ino_t		 ino;
+	off_t		 size;
+	time_t		 mtime;
+};
+
+static const gchar *uidlist_filenames[] = { DOVECOT_UIDLIST, COURIER_UIDDB };
+
+const gchar *uidlist_get_filename(UidListType type)
+{
+	return uidlist_filenames[type];
+}
+
+static gboolean parse_header(UidList *list, const gchar *line)
+{
+	gchar **tokens;
+	gint i;
+
+	tokens = g_strsplit(line, " ", 0);
+	list->version = tokens[0] != NULL ? atoi(tokens[0]) : 0;
+
+	if (list->type == UIDLIST_DOVECOT && list->version == 3) {
+		for (i = 1; tokens[i] != NULL; i++) {
+			if (tokens[i][0] == 'V')
+				list->uidvalidity = strtoul(tokens[i] + 1, NULL, 10);
+			else if (tokens[i][0] == 'N')
+				list->nextuid = strtoul(tokens[i] + 1, NULL, 10);
+		}
+	} else if (list->version == 1 ||
+		   (list->type == UIDLIST_COURIER && list->version == 2)) {
+		if (tokens[1] != NULL && tokens[2] != NULL) {
+			list->uidvalidity = strtoul(tokens[1], NULL, 10);
+			list->nextuid = strtoul(tokens[2], NULL, 10);
+		}
+	} else
+		g_warning("Maildir: unsupported %s version %d\n",
+			  uidlist_filenames[list->type], list->version);
+	g_strfreev(tokens);
+
+	return list->uidvalidity != 0;
+}
+
+static void parse_record(UidList *list, gchar *line)
+{
+	gchar *name, *end, *info;
+	guint32 uid;
+
+	uid = strtoul(line, &end, 10);
+	if (end != line && *end == ' ') {
+		/* "<uid> <filename>" or Dovecot's "<uid> [ext ...] :<filename>" */
+		name = end + 1;
+		if (list->type == UIDLIST_DOVECOT && list->version == 3) {
+			if (*name != ':' && (name = strstr(name, " :")) == NULL)
+				return;
+			name += *name == ':' ? 1 : 2;
+		}
+	} else if (list->type == UIDLIST_COURIER &&
+		   (end = strrchr(line, ' ')) != NULL) {
+		/* "<filename> <uid>" */
+		*end++ = '\0';
+		uid = strtoul(end, NULL, 10);
+		name = line;
+	} else
+		return;
+
+	if ((info = strchr(name, ':')) != NULL)
+		*info = '\0';
+	if (uid == 0 || *name == '\0')
+		return;
+
+	g_hash_table_replace(list->uids, g_strdup(name), GUINT_TO_POINTER(uid));
+	if (uid >= list->nextuid)
+		list->nextuid = uid + 1;
+}
+
+/* Reads the list line by line from fp */
+static UidList *read_uidlist(FILE *fp, UidListType type)
+{
+	UidList *list;
+	struct stat st;
+	gchar *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	gboolean header = TRUE;
+
+	if (fstat(fileno(fp), &st) < 0)
+		return NULL;
+
+	list = g_new0(UidList, 1);
+	list->type = type;
+	list->uids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	list->dev = st.st_dev;
+	list->ino = st.st_ino;
+	list->size = st.st_size;
+	list->mtime = st.st_mtime;
+
+	while ((len = getline(&line, &size, fp)) != -1) {
+		if (len > 0 && line[len - 1] == '\n')
+			line[len - 1] = '\0';
+
+		if (header) {
+			if (!parse_header(list, line))
+				break;
+			header = FALSE;
+		} else
+			parse_record(list, line);
+	}
+	free(line);
+
+	if (header) {
+		/* empty or unusable */
+		uidlist_free(list);
+		return NULL;
+	}
+
+	return list;
+}
+
+/* Brings *list up to date with the list of the given type in dir, which
+ * is only read again if the file changed. *list is NULL if there is no
+ * usable list. Returns TRUE if *list changed. */
+gboolean uidlist_update(UidList **list, UidListType type, const gchar *dir)
+{
+	UidList *old = *list;
+	struct stat st;
+	gchar *file;
+	FILE *fp;
+
+	file = g_strconcat(dir, G_DIR_SEPARATOR_S, uidlist_filenames[type], NULL);
+
+	if (old != NULL && old->type == type && stat(file, &st) == 0 &&
+	    st.st_dev == old->dev && st.st_ino == old->ino &&
+	    st.st_size == old->size && st.st_mtime == old->mtime) {
+		g_free(file);
+		return FALSE;
+	}
+
+	if ((fp = fopen(file, "rb")) != NULL) {
+		*list = read_uidlist(fp, type);
+		fclose(fp);
+	} else
+		*list = NULL;
+	g_free(file);
+
+	if (old != NULL)
+		uidlist_free(old);
+
+	return old != NULL || *list != NULL;
+}
+
+void uidlist_free(UidList *list)
+{
+	g_return_if_fail(list != NULL);
+
+	g_hash_table_destroy(list->uids);
+	g_free(list);
+}
+
+/* Returns the server's UID of the message with the uniq or 0 */
+guint32 uidlist_get_uid(UidList *list, const gchar *uniq)
+{
+	g_return_val_if_fail(list != NULL, 0);
+
+	return GPOINTER_TO_UINT(g_hash_table_lookup(list->uids, uniq));
+}
+
+guint32 uidlist_get_uidvalidity(UidList *list)
+{
+	g_return_val_if_fail(list != NULL, 0);
+
+	return list->uidvalidity;
+}
+
+guint32 uidlist_get_next_uid(UidList *list)
+{
+	g_return_val_if_fail(list != NULL, 0);
+
+	return list->nextuid;
+}
+
+/* Creates the dotlock, waiting a few seconds for another holder and
+ * breaking locks that were left behind */
+static gint lock_uidlist(const gchar *lockfile)
+{
+	struct stat st;
+	gint fd, i;
+
+	for (i = 0; i < LOCK_TRIES; i++) {
+		fd = open(lockfile, O_WRONLY | O_CREAT | O_EXCL, 0600);
+		if (fd >= 0 || errno != EEXIST)
+			return fd;
+
+		if (stat(lockfile, &st) == 0 &&
+		    time(NULL) - st.st_mtime > LOCK_STALE_TIMEOUT) {
+			g_warning("Maildir: removing stale lock %s\n", lockfile);
+			unlink(lockfile);
+			continue;
+		}
+		g_usleep(LOCK_RETRY_DELAY);
+	}
+
+	errno = EAGAIN;
+	return -1;
+}
+
+static gboolean write_all(gint fd, const gchar *buf, gsize len)
+{
+	while (len > 0) {
+		ssize_t w = write(fd, buf, len);
+
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return FALSE;
+		buf += w;
+		len -= w;
+	}
+
+	return TRUE;
+}
+
+/* Replaces the next UID in the header line */
+static gchar *make_header(UidList *list, const gchar *line)
+{
+	gchar **tokens, *header;
+	gint i;
+
+	tokens = g_strsplit(line, " ", 0);
+	for (i = 1; tokens[i] != NULL; i++) {
+		if ((list->version == 1 && i == 2) ||
+		    (list->version == 3 && tokens[i][0] == 'N')) {
+			g_free(tokens[i]);
+			tokens[i] = g_strdup_printf(list->version == 1 ? "%u" : "N%u",
+						    list->nextuid);
+		}
+	}
+	header = g_strjoinv(" ", tokens);
+	g_strfreev(tokens);
+
+	return header;
+}
+
+/* Writes the list in fp with the new header and records to fd */
+static gboolean write_uidlist(gint fd, FILE *fp, UidList *list, GString *records)
+{
+	gchar *line = NULL, *header;
+	size_t size = 0;
+	ssize_t len;
+	gboolean ok;
+
+	rewind(fp);
+	if ((len = getline(&line, &size, fp)) <= 0) {
+		free(line);
+		return FALSE;
+	}
+	if (line[len - 1] == '\n')
+		line[len - 1] = '\0';
+	header = make_header(list, line);
+	ok = write_all(fd, header, strlen(header)) && write_all(fd, "\n", 1);
+	g_free(header);
+
+	while (ok && (len = getline(&line, &size, fp)) > 0) {
+		ok = write_all(fd, line, len) &&
+		     (line[len - 1] == '\n' || write_all(fd, "\n", 1));
+	}
+	free(line);
+
+	return ok && write_all(fd, records->str, records->len) && fsync(fd) == 0;
+}
+
+/* Gives the messages in names (file names in cur/ or new/) the next
+ * UIDs of the list in dir. Messages that are listed already are skipped.
+ * Only dovecot-uidlist can be written and it is not created if it
+ * doesn't exist. Returns the number of messages added or -1 on error. */
+gint uidlist_append(UidListType type, const gchar *dir, GSList *names)
+{
+	UidList *list = NULL;
+	gchar *file, *lockfile;
+	GString *records, *uniq;
+	struct stat st;
+	GSList *cur;
+	FILE *fp;
+	gint fd, added = 0;
+	gboolean ok;
+
+	g_return_val_if_fail(type == UIDLIST_DOVECOT, -1);
+
+	file = g_strconcat(dir, G_DIR_SEPARATOR_S, DOVECOT_UIDLIST, NULL);
+	lockfile = g_strconcat(dir, G_DIR_SEPARATOR_S, DOVECOT_UIDLIST_LOCK, NULL);
+
+	if ((fd = lock_uidlist(lockfile)) < 0) {
+		g_warning("Maildir: can't lock %s: %s\n", file, g_strerror(errno));
+		g_free(lockfile);
+		g_free(file);
+		return -1;
+	}
+
+	/* read the list again, somebody may have changed it meanwhile */
+	if ((fp = fopen(file, "rb")) != NULL)
+		list = read_uidlist(fp, type);
+	if (list == NULL) {
+		added = -1;
+		goto unlock;
+	}
+
+	records = g_string_new(NULL);
+	/* one buffer for the uniq part of all names */
+	uniq = g_string_new(NULL);
+	for (cur = names; cur != NULL; cur = g_slist_next(cur)) {
+		const gchar *name = (const gchar *) cur->data;
+		const gchar *info;
+
+		info = strchr(name, ':');
+		g_string_truncate(uniq, 0);
+		g_string_append_len(uniq, name, info != NULL ? info - name : strlen(name));
+		if (g_hash_table_lookup(list->uids, uniq->str) != NULL)
+			continue;
+
+		g_hash_table_insert(list->uids, g_strdup(uniq->str),
+				    GUINT_TO_POINTER(list->nextuid));
+		g_string_append_printf(records, list->version == 1 ?
+				       "%u %s\n" : "%u :%s\n",
+				       list->nextuid++, name);
+		added++;
+	}
+	g_string_free(uniq, TRUE);
+
+	if (added == 0) {
+		g_string_free(records, TRUE);
+		uidlist_free(list);
+		goto unlock;
+	}
+
+	if (fstat(fileno(fp), &st) == 0)
+		fchmod(fd, st.st_mode & 0777);
+	ok = write_uidlist(fd, fp, list, records);
+
+	g_string_free(records, TRUE);
+	uidlist_free(list);
+	fclose(fp);
+
+	if (close(fd) == 0 && ok && rename(lockfile, file) == 0) {
+		g_free(lockfile);
+		g_free(file);
+		return added;
+	}
+
+	g_warning("Maildir: can't write %s: %s\n", file, g_strerror(errno));
+	unlink(lockfile);
+	g_free(lockfile);
+	g_free(file);
+	return -1;
+
+unlock:
+	if (fp != NULL)
+		fclose(fp);
+	close(fd);
+	unlink(lockfile);
+	g_free(lockfile);
+	g_free(file);
+	return added;
+}
@@ -0,0 +1,45 @@
+/*
+ * Maildir Plugin -- Maildir++ support for Sylpheed
+ * Copyright (C) 2003 Christoph Hohmann
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef UIDLIST_H
+#define UIDLIST_H 1
+
+#include <glib.h>
+
+/* UID lists kept by IMAP servers in the Maildir */
+typedef enum
+{
+	UIDLIST_DOVECOT,
+	UIDLIST_COURIER
+} UidListType;
+
+#define DOVECOT_UIDLIST		"dovecot-uidlist"
+#define COURIER_UIDDB		"courierimapuiddb"
+
+typedef struct _UidList UidList;
+
+const gchar *uidlist_get_filename(UidListType);
+gboolean uidlist_update(UidList **, UidListType, const gchar *);
+void uidlist_free(UidList *);
+guint32 uidlist_get_uid(UidList *, const gchar *);
+guint32 uidlist_get_uidvalidity(UidList *);
+guint32 uidlist_get_next_uid(UidList *);
+gint uidlist_append(UidListType, const gchar *, GSList *);
+
+#endif /* UIDLIST_H */